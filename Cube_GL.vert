@@ -0,0 +1,31 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// per cube instance
+layout (location = 2) in vec3 cubePosition;
+layout (location = 3) in vec4 cubeRoll;     // unit rotation axis, angle in degrees
+layout (location = 4) in vec3 cubePivot;    // a point on the edge the block rolls over
+
+uniform mat4 VP;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+// Rodrigues' rotation of p about the roll axis through the pivot
+vec3 roll (vec3 p)
+{
+    float a = radians(cubeRoll.w);
+    vec3 k = cubeRoll.xyz;
+    vec3 d = p - cubePivot;
+    return cubePivot + d*cos(a) + cross(k, d)*sin(a) + k*dot(k, d)*(1.0 - cos(a));
+}
+
+void main ()
+{
+    fragColor = vertexColor;
+
+    gl_Position = VP * vec4(roll(cubePosition + vertexPosition), 1);
+}
@@ -0,0 +1,18 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// per HUD quad instance, on the 4.5 path
+layout (location = 2) in mat4 hudMVP;       // locations 2-5
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    fragColor = vertexColor;
+
+    gl_Position = hudMVP * vec4(vertexPosition, 1);
+}
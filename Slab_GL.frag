@@ -0,0 +1,31 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 pattern;
+flat in vec3 edge;
+flat in vec3 centre;
+
+// output data
+out vec3 color;
+
+// A merged quad spans many tiles, so the shading each tile face mesh had
+// (edge colour at the rim, centre colour in the middle) is redone per tile here
+void main()
+{
+    float u = mod(pattern.x + 5.0, 10.0) - 5.0;
+    float w;
+    if(pattern.z == 0.0)
+    {
+        float v = mod(pattern.y + 5.0, 10.0) - 5.0;
+        w = max(abs(u), abs(v)) / 5.0;
+    }
+    else
+    {
+        // the wall mesh only has its left and upper triangles
+        float v = pattern.y;
+        if(-u/5.0 < abs(v) && v < abs(u)/5.0)
+            discard;
+        w = max(abs(u)/5.0, abs(v));
+    }
+    color = mix(centre, edge, w);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexPattern;  // across and up the face in tile units, and 1 on walls
+layout (location = 2) in vec3 edgeColor;
+layout (location = 3) in vec3 centreColor;
+
+uniform mat4 VP;
+uniform float height;   // stage height while no wave runs
+
+// output data : used by fragment shader
+out vec3 pattern;
+flat out vec3 edge;
+flat out vec3 centre;
+
+void main ()
+{
+    pattern = vertexPattern;
+    edge = edgeColor;
+    centre = centreColor;
+
+    gl_Position = VP * vec4(vertexPosition + vec3(0, 0, height), 1);
+}
@@ -0,0 +1,41 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// per tile instance
+layout (location = 2) in vec3 tilePosition;
+layout (location = 3) in vec3 tileCell;     // grid i, j, and 1 if the tile follows the stage wave
+layout (location = 4) in float tileFace;    // which of faces[] - per instance on the 4.5 path, constant otherwise
+
+uniform mat4 VP;
+uniform mat4 faces[12]; // where each face sits inside a tile, TILE_FACES in ans.cpp
+uniform vec2 wave;      // mode (0 none, 1 rise in, 2 sink out), zs
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+// Height of the tile, as Stage::animateStage used to compute it per tile
+float waveHeight ()
+{
+    if(tileCell.z == 0.0)
+        return tilePosition.z;
+    if(wave.x == 1.0)
+        return min(wave.y + 2.0*tileCell.x + 3.0*tileCell.y, 0.0);
+    if(wave.x == 2.0)
+    {
+        float z = wave.y - 2.0*(14.0-tileCell.x) - 3.0*(9.0-tileCell.y);
+        return z < -90.0 ? -100.0 : z;
+    }
+    return wave.y;
+}
+
+void main ()
+{
+    vec3 tile = vec3(tilePosition.xy, waveHeight());
+
+    fragColor = vertexColor;
+
+    gl_Position = VP * vec4(tile + (faces[int(tileFace)] * vec4(vertexPosition, 1)).xyz, 1);
+}
@@ -2,6 +2,24 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <csignal>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <cstdlib>
+#include <climits>
+#include <ctime>
+#include <sys/stat.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -13,16 +31,7 @@
 
 using namespace std;
 
-struct VAO {
-    GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
-
-    GLenum PrimitiveMode;
-    GLenum FillMode;
-    int NumVertices;
-};
-typedef struct VAO VAO;
+#include "scene.h"
 
 struct GLMatrices {
   glm::mat4 projection;
@@ -33,310 +42,1391 @@ struct GLMatrices {
 
 GLuint programID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* OpenGL 4.5 fast path, taken when the context has direct state access and
+   multi-draw-indirect with base instances (4.5 core, or the ARB extensions).
+   GL objects are then set up through DSA and the stage, block and HUD draws are
+   gathered into command buffers for glMultiDrawArraysIndirect. Otherwise, or
+   with --no-fast-path, everything stays on the 3.3 path */
+bool fast_path = false;
+bool fast_path_allowed = true;
+
+/* GPU resources. Static meshes are sub-allocated out of one shared vertex
+   buffer behind one vertex array, so a mesh handle is only the range of
+   vertices it was given. Every other GL object is created through here as
+   well, which keeps count of what is alive and lets release() delete it all
+   while the context is still current - render thread only */
+struct GpuResources {
+  GLuint mesh_array, mesh_buffer;
+  int mesh_capacity, mesh_top;              // in vertices
+  vector< pair<int,int> > mesh_free;        // released ranges below mesh_top: first, count
+  int meshes;                               // live mesh handles
+
+  std::map<GLuint, long> buffers;           // live objects and their storage in bytes
+  std::map<GLuint, long> renderbuffers;
+  vector<GLuint> vertex_arrays, framebuffers, programs;
+
+  GpuResources() : mesh_array(0), mesh_buffer(0), mesh_capacity(0), mesh_top(0), meshes(0) {}
+
+  GLuint buffer()
+  {
+    GLuint id;
+    if(fast_path)
+      glCreateBuffers(1, &id);
+    else
+      glGenBuffers(1, &id);
+    buffers[id] = 0;
+    return id;
+  }
 
-  // Create the shaders
-  GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-  GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+  /* (Re)specify the storage of buffer id. On the 3.3 path it is left bound to GL_ARRAY_BUFFER */
+  void bufferData(GLuint id, long bytes, const void *data, GLenum usage)
+  {
+    if(fast_path)
+      glNamedBufferData(id, bytes, data, usage);
+    else
+    {
+      glBindBuffer(GL_ARRAY_BUFFER, id);
+      glBufferData(GL_ARRAY_BUFFER, bytes, data, usage);
+    }
+    buffers[id] = bytes;
+  }
+
+  void deleteBuffer(GLuint id)
+  {
+    glDeleteBuffers(1, &id);
+    buffers.erase(id);
+  }
 
-  // Read the Vertex Shader code from the file
-  std::string VertexShaderCode;
-  std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-  if(VertexShaderStream.is_open())
+  GLuint vertexArray()
   {
-    std::string Line = "";
-    while(getline(VertexShaderStream, Line))
-      VertexShaderCode += "\n" + Line;
-    VertexShaderStream.close();
+    GLuint id;
+    if(fast_path)
+      glCreateVertexArrays(1, &id);
+    else
+      glGenVertexArrays(1, &id);
+    vertex_arrays.push_back(id);
+    return id;
   }
 
-  // Read the Fragment Shader code from the file
-  std::string FragmentShaderCode;
-  std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-  if(FragmentShaderStream.is_open()){
-    std::string Line = "";
-    while(getline(FragmentShaderStream, Line))
-      FragmentShaderCode += "\n" + Line;
-    FragmentShaderStream.close();
+  GLuint framebuffer()
+  {
+    GLuint id;
+    if(fast_path)
+      glCreateFramebuffers(1, &id);
+    else
+      glGenFramebuffers(1, &id);
+    framebuffers.push_back(id);
+    return id;
   }
 
-  GLint Result = GL_FALSE;
-  int InfoLogLength;
+  GLuint renderbuffer()
+  {
+    GLuint id;
+    if(fast_path)
+      glCreateRenderbuffers(1, &id);
+    else
+      glGenRenderbuffers(1, &id);
+    renderbuffers[id] = 0;
+    return id;
+  }
+
+  void renderbufferStorage(GLuint id, GLenum format, int width, int height, int bytes_per_pixel)
+  {
+    if(fast_path)
+      glNamedRenderbufferStorage(id, format, width, height);
+    else
+    {
+      glBindRenderbuffer(GL_RENDERBUFFER, id);
+      glRenderbufferStorage(GL_RENDERBUFFER, format, width, height);
+    }
+    renderbuffers[id] = (long)width*height*bytes_per_pixel;
+  }
+
+  /* Take ownership of a linked program */
+  GLuint program(GLuint id)
+  {
+    programs.push_back(id);
+    return id;
+  }
+
+  /* Room for count vertices in the shared mesh buffer, first fit over released ranges */
+  int allocMesh(int count)
+  {
+    for(size_t f=0;f<mesh_free.size();f++)
+      if(mesh_free[f].second>=count)
+      {
+        int first = mesh_free[f].first;
+        mesh_free[f].first += count;
+        mesh_free[f].second -= count;
+        if(mesh_free[f].second==0)
+          mesh_free.erase(mesh_free.begin()+f);
+        return first;
+      }
+    if(mesh_top+count>mesh_capacity)
+      growMeshBuffer(max(2*mesh_capacity, max(mesh_top+count, 4096)));
+    mesh_top += count;
+    return mesh_top-count;
+  }
+
+  /* Give a mesh range back - bookkeeping only, so fine after release() */
+  void freeMesh(int first, int count)
+  {
+    vector< pair<int,int> >::iterator at = mesh_free.begin();
+    while(at!=mesh_free.end() && at->first<first)
+      ++at;
+    at = mesh_free.insert(at, make_pair(first, count));
+    // merge with the ranges either side
+    if(at+1!=mesh_free.end() && at->first+at->second==(at+1)->first)
+    {
+      at->second += (at+1)->second;
+      mesh_free.erase(at+1);
+    }
+    if(at!=mesh_free.begin() && (at-1)->first+(at-1)->second==at->first)
+    {
+      (at-1)->second += at->second;
+      at = mesh_free.erase(at)-1;
+    }
+    if(at->first+at->second==mesh_top)
+    {
+      mesh_top = at->first;
+      mesh_free.erase(at);
+    }
+  }
+
+  /* Move the meshes into a bigger buffer, the vertex array keeps its name */
+  void growMeshBuffer(int capacity)
+  {
+    GLuint old = mesh_buffer;
+    mesh_buffer = buffer();
+    bufferData(mesh_buffer, (long)capacity*sizeof(MeshVertex), NULL, GL_STATIC_DRAW);
+    if(old!=0)
+    {
+      if(fast_path)
+        glCopyNamedBufferSubData(old, mesh_buffer, 0, 0, (long)mesh_top*sizeof(MeshVertex));
+      else
+      {
+        glBindBuffer(GL_COPY_READ_BUFFER, old);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0, 0, (long)mesh_top*sizeof(MeshVertex));
+      }
+      deleteBuffer(old);
+    }
+    else
+      mesh_array = vertexArray();
+    mesh_capacity = capacity;
+
+    if(fast_path)
+    {
+      glVertexArrayVertexBuffer(mesh_array, 0, mesh_buffer, 0, sizeof(MeshVertex));
+      meshAttribs(mesh_array);
+      return;
+    }
+    glBindVertexArray(mesh_array);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, color));
+  }
+
+  /* Position and colour of a DSA vertex array, read from binding 0 */
+  void meshAttribs(GLuint vao)
+  {
+    glEnableVertexArrayAttrib(vao, 0);
+    glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(MeshVertex, position));
+    glVertexArrayAttribBinding(vao, 0, 0);
+    glEnableVertexArrayAttrib(vao, 1);
+    glVertexArrayAttribFormat(vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(MeshVertex, color));
+    glVertexArrayAttribBinding(vao, 1, 0);
+  }
+
+  void report(const char *when)
+  {
+    long bytes = 0, storage = 0;
+    for(std::map<GLuint, long>::iterator b=buffers.begin();b!=buffers.end();++b)
+      bytes += b->second;
+    for(std::map<GLuint, long>::iterator r=renderbuffers.begin();r!=renderbuffers.end();++r)
+      storage += r->second;
+    printf("GPU %s: %d buffers (%ld bytes), %d renderbuffers (%ld bytes), %d vertex arrays, %d framebuffers, %d programs\n",
+           when, (int)buffers.size(), bytes, (int)renderbuffers.size(), storage, (int)vertex_arrays.size(),
+           (int)framebuffers.size(), (int)programs.size());
+    printf("  %d meshes in %d of %d shared vertices\n", meshes, mesh_top, mesh_capacity);
+  }
+
+  /* Delete every GL object still alive, before the context goes */
+  void release()
+  {
+    for(std::map<GLuint, long>::iterator b=buffers.begin();b!=buffers.end();++b)
+      glDeleteBuffers(1, &b->first);
+    for(std::map<GLuint, long>::iterator r=renderbuffers.begin();r!=renderbuffers.end();++r)
+      glDeleteRenderbuffers(1, &r->first);
+    if(!vertex_arrays.empty())
+      glDeleteVertexArrays(vertex_arrays.size(), &vertex_arrays[0]);
+    if(!framebuffers.empty())
+      glDeleteFramebuffers(framebuffers.size(), &framebuffers[0]);
+    for(size_t p=0;p<programs.size();p++)
+      glDeleteProgram(programs[p]);
+    buffers.clear();
+    renderbuffers.clear();
+    vertex_arrays.clear();
+    framebuffers.clear();
+    programs.clear();
+    mesh_array = mesh_buffer = 0;
+  }
+} gpu;
+
+/* Per-frame dynamic data - tile, cube and HUD instances, indirect commands - is
+   written linearly into one streaming buffer, in a section per frame in flight.
+   The fence set after a frame tells when its section may be written again, so
+   nothing waits on the GPU unless it falls STREAM_FRAMES frames behind. With
+   GL 4.4 or ARB_buffer_storage the buffer stays mapped, otherwise each write is
+   an unsynchronised map of its range */
+#define STREAM_FRAMES 3
+
+struct StreamRing {
+  GLuint buffer;
+  char *mapped;             // persistent mapping, or NULL
+  long section;             // bytes per frame
+  int frame;                // section being written
+  long used;                // ... bytes of it so far
+  GLsync fences[STREAM_FRAMES];
+
+  long frames, stalls, grows;
+  double stall_ms;
+  vector<long> usage;       // bytes written per frame
+
+  StreamRing() : buffer(0), mapped(NULL), section(0), frame(0), used(0), frames(0), stalls(0), grows(0), stall_ms(0)
+  {
+    for(int f=0;f<STREAM_FRAMES;f++)
+      fences[f] = 0;
+  }
+
+  void create(long bytes)
+  {
+    section = bytes;
+    buffer = gpu.buffer();
+    long size = STREAM_FRAMES*section;
+    if(GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage)
+    {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      if(fast_path)
+      {
+        glNamedBufferStorage(buffer, size, NULL, flags);
+        mapped = (char *)glMapNamedBufferRange(buffer, 0, size, flags);
+      }
+      else
+      {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        mapped = (char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+      }
+      gpu.buffers[buffer] = size;
+    }
+    else
+      gpu.bufferData(buffer, size, NULL, GL_STREAM_DRAW);
+  }
+
+  /* Wait, if need be, until the GPU is done with the section this frame reuses */
+  void beginFrame()
+  {
+    frame = (frame+1)%STREAM_FRAMES;
+    used = 0;
+    GLsync &fence = fences[frame];
+    if(!fence)
+      return;
+    if(glClientWaitSync(fence, 0, 0)==GL_TIMEOUT_EXPIRED)
+    {
+      double t = glfwGetTime();
+      GLenum r;
+      do
+        r = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+      while(r==GL_TIMEOUT_EXPIRED);
+      stalls++;
+      stall_ms += (glfwGetTime()-t)*1000;
+    }
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  void endFrame()
+  {
+    fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    usage.push_back(used);
+    frames++;
+  }
+
+  /* Room for bytes in this frame's section - returns its offset in buffer. When the
+     section is full the buffer is replaced by one twice the size. Offsets handed
+     out earlier stay valid for draws already issued, not for later ones */
+  long alloc(long bytes)
+  {
+    long at = (used+15) & ~15L;
+    if(at+bytes>section)
+    {
+      for(int f=0;f<STREAM_FRAMES;f++)
+        if(fences[f])
+        {
+          glDeleteSync(fences[f]);
+          fences[f] = 0;
+        }
+      gpu.deleteBuffer(buffer);     // the driver keeps it until draws reading it are done
+      mapped = NULL;
+      create(max(2*section, bytes));
+      grows++;
+      at = 0;
+    }
+    used = at+bytes;
+    return (long)frame*section + at;
+  }
+
+  void fill(long at, const void *data, long bytes)
+  {
+    if(bytes<=0)
+      return;
+    if(mapped)
+    {
+      memcpy(mapped+at, data, bytes);
+      return;
+    }
+    // the fences already keep the GPU off this range
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+    void *p;
+    if(fast_path)
+      p = glMapNamedBufferRange(buffer, at, bytes, flags);
+    else
+    {
+      glBindBuffer(GL_ARRAY_BUFFER, buffer);
+      p = glMapBufferRange(GL_ARRAY_BUFFER, at, bytes, flags);
+    }
+    if(p)
+      memcpy(p, data, bytes);
+    if(fast_path)
+      glUnmapNamedBuffer(buffer);
+    else
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+
+  long write(const void *data, long bytes)
+  {
+    long at = alloc(bytes);
+    fill(at, data, bytes);
+    return at;
+  }
+
+  void report()
+  {
+    if(frames==0)
+      return;
+    vector<long> u = usage;
+    sort(u.begin(), u.end());
+    double sum=0;
+    for(size_t i=0;i<u.size();i++)
+      sum+=u[i];
+    printf("Stream buffer: %d x %ld bytes%s, %ld grows\n", STREAM_FRAMES, section,
+           mapped ? " persistently mapped" : "", grows);
+    printf("  bytes per frame: mean %.0f  p90 %ld  max %ld\n", sum/u.size(), u[u.size()*9/10], u.back());
+    printf("  %ld stalls on the GPU in %ld frames, %.1f ms waited\n", stalls, frames, stall_ms);
+  }
+
+  void release()
+  {
+    for(int f=0;f<STREAM_FRAMES;f++)
+      if(fences[f])
+      {
+        glDeleteSync(fences[f]);
+        fences[f] = 0;
+      }
+    mapped = NULL;          // unmapped with the buffer in gpu.release
+  }
+} stream;
+
+/* Wall-clock phases from launch to the first frame, recorded from any thread */
+class StartupProfile {
+  struct Phase {
+    const char *name;
+    double start, end;      // ms since launch
+    bool worker;
+  };
+  std::chrono::steady_clock::time_point launched;
+  vector<Phase> phases;
+  std::mutex lock;
+
+public:
+  StartupProfile() : launched(std::chrono::steady_clock::now()) {}
+
+  double now()
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-launched).count();
+  }
+
+  /* A phase that began at start (from now()) has just finished */
+  void add(const char *name, double start, bool worker=false)
+  {
+    Phase phase = { name, start, now(), worker };
+    std::lock_guard<std::mutex> guard(lock);
+    phases.push_back(phase);
+  }
+
+  void report()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    printf("Startup (ms since launch):\n");
+    for(size_t i=0;i<phases.size();i++)
+      printf("  %-18s %8.1f - %8.1f  %8.1f%s\n", phases[i].name, phases[i].start, phases[i].end,
+             phases[i].end-phases[i].start, phases[i].worker ? "  (worker)" : "");
+    printf("  first frame after %.1f ms\n", now());
+  }
+} startup;
+
+/* GLSL sources, embedded at build time from the .vert/.frag files (see Makefile) */
+#include "shaders.h"
+
+/* Shader startup counters, printed once the first frame is up */
+struct ShaderStats {
+  int programs, cached;
+  bool use_cache;
+  ShaderStats() : programs(0), cached(0), use_cache(true) {}
+} shader_stats;
+
+/* Print a shader or program info log, if there is anything in it */
+void printInfoLog(GLuint object, bool program)
+{
+  int InfoLogLength = 0;
+  if(program)
+    glGetProgramiv(object, GL_INFO_LOG_LENGTH, &InfoLogLength);
+  else
+    glGetShaderiv(object, GL_INFO_LOG_LENGTH, &InfoLogLength);
+  if(InfoLogLength<=1)
+    return;
+  std::vector<char> ErrorMessage(InfoLogLength);
+  if(program)
+    glGetProgramInfoLog(object, InfoLogLength, NULL, &ErrorMessage[0]);
+  else
+    glGetShaderInfoLog(object, InfoLogLength, NULL, &ErrorMessage[0]);
+  fprintf(stdout, "%s\n", &ErrorMessage[0]);
+}
+
+/* Compile and link a program from GLSL source */
+GLuint CompileProgram(const char *name, const char *vertex_code, const char *fragment_code, bool retrievable)
+{
+  // Create the shaders
+  GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+  GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
   // Compile Vertex Shader
-  printf("Compiling shader : %s\n", vertex_file_path);
-  char const * VertexSourcePointer = VertexShaderCode.c_str();
-  glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
+  printf("Compiling shaders : %s\n", name);
+  glShaderSource(VertexShaderID, 1, &vertex_code , NULL);
   glCompileShader(VertexShaderID);
-
-  // Check Vertex Shader
-  glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-  glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-  std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-  glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-  fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
+  printInfoLog(VertexShaderID, false);
 
   // Compile Fragment Shader
-  printf("Compiling shader : %s\n", fragment_file_path);
-  char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-  glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
+  glShaderSource(FragmentShaderID, 1, &fragment_code , NULL);
   glCompileShader(FragmentShaderID);
-
-  // Check Fragment Shader
-  glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-  glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-  std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-  glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-  fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+  printInfoLog(FragmentShaderID, false);
 
   // Link the program
-  fprintf(stdout, "Linking program\n");
   GLuint ProgramID = glCreateProgram();
   glAttachShader(ProgramID, VertexShaderID);
   glAttachShader(ProgramID, FragmentShaderID);
+  if(retrievable)
+    glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(ProgramID);
+  printInfoLog(ProgramID, true);
 
-  // Check the program
-  glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-  glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-  std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-  glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-  fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
-
+  glDetachShader(ProgramID, VertexShaderID);
+  glDetachShader(ProgramID, FragmentShaderID);
   glDeleteShader(VertexShaderID);
   glDeleteShader(FragmentShaderID);
 
   return ProgramID;
 }
 
-static void error_callback(int error, const char* description)
+/* Linked programs are cached in $XDG_CACHE_HOME/minibloxorz (or ~/.cache/minibloxorz),
+   one file per program named after a hash of the driver strings and the sources */
+string programCachePath(const char *name, const char *vertex_code, const char *fragment_code)
 {
-    fprintf(stderr, "Error: %s\n", description);
+  string dir;
+  if(getenv("XDG_CACHE_HOME"))
+    dir = getenv("XDG_CACHE_HOME");
+  else if(getenv("HOME"))
+    dir = string(getenv("HOME")) + "/.cache";
+  else
+    return "";
+  mkdir(dir.c_str(), 0755);
+  dir += "/minibloxorz";
+  mkdir(dir.c_str(), 0755);
+
+  const char *parts[] = { (const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER),
+                          (const char *)glGetString(GL_VERSION), vertex_code, fragment_code };
+  uint64_t h = 14695981039346656037ULL;
+  for(int i=0;i<5;i++)
+    for(const char *c = parts[i] ? parts[i] : ""; ; c++)
+    {
+      h = (h ^ (unsigned char)*c) * 1099511628211ULL;   // the terminator separates the parts
+      if(*c==0)
+        break;
+    }
+
+  char file[64];
+  snprintf(file, sizeof(file), "/%s-%016llx.bin", name, (unsigned long long)h);
+  return dir + file;
 }
 
-void quit(GLFWwindow *window)
+/* Get a linked program for the given sources, from the binary cache when the driver allows it */
+GLuint LoadShaders(const char *name, const char *vertex_code, const char *fragment_code)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
-//    exit(EXIT_SUCCESS);
-}
+  GLint formats = 0;
+  if(GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  bool binaries = formats>0;
+  string path = binaries ? programCachePath(name, vertex_code, fragment_code) : "";
+  GLuint ProgramID = 0;
+  GLint Result = GL_FALSE;
 
+  shader_stats.programs++;
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
-{
-    struct VAO* vao = new struct VAO;
-    vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
-    vao->FillMode = fill_mode;
+  // Warm start: hand the driver back what it gave us last time
+  if(shader_stats.use_cache && path!="")
+  {
+    std::ifstream cache(path.c_str(), std::ios::in | std::ios::binary);
+    GLenum format;
+    if(cache.read((char *)&format, sizeof(format)))
+    {
+      std::vector<char> blob((std::istreambuf_iterator<char>(cache)), std::istreambuf_iterator<char>());
+      ProgramID = glCreateProgram();
+      glProgramBinary(ProgramID, format, blob.empty() ? NULL : &blob[0], blob.size());
+      glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+      if(Result==GL_TRUE)
+      {
+        shader_stats.cached++;
+        return gpu.program(ProgramID);
+      }
+      // driver update or a stale file, compile it again
+      glDeleteProgram(ProgramID);
+    }
+  }
 
-    // Create Vertex Array Object
-    // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+  ProgramID = CompileProgram(name, vertex_code, fragment_code, binaries);
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-                          0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+  glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+  if(Result==GL_TRUE && path!="")
+  {
+    GLint length = 0;
+    glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length>0)
+    {
+      std::vector<char> blob(length);
+      GLenum format;
+      glGetProgramBinary(ProgramID, length, NULL, &format, &blob[0]);
+      std::ofstream cache(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+      cache.write((const char *)&format, sizeof(format));
+      cache.write(&blob[0], length);
+    }
+  }
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+  return gpu.program(ProgramID);
+}
 
-    return vao;
+static void error_callback(int error, const char* description)
+{
+    fprintf(stderr, "Error: %s\n", description);
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+/* Ask the main loop to stop - it shuts the simulation thread down before the window goes */
+void quit(GLFWwindow *window)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
+    glfwSetWindowShouldClose(window, 1);
+//    exit(EXIT_SUCCESS);
+}
+
+
+/* Meshes in the shared vertex buffer, drawn with programID */
+class GlBackend : public RenderBackend {
+public:
+  void upload(VAO *vao, const MeshVertex *vertices)
+  {
+    // Should be done after CreateWindow and before any other GL calls
+    vao->First = gpu.allocMesh(vao->NumVertices);
+    vao->VertexArrayID = gpu.mesh_array;
+    if (fast_path)
+        glNamedBufferSubData (gpu.mesh_buffer, vao->First*sizeof(MeshVertex), vao->NumVertices*sizeof(MeshVertex), vertices);
+    else {
+        glBindBuffer (GL_ARRAY_BUFFER, gpu.mesh_buffer);
+        glBufferSubData (GL_ARRAY_BUFFER, vao->First*sizeof(MeshVertex), vao->NumVertices*sizeof(MeshVertex), vertices);
     }
+    gpu.meshes++;
+  }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
-}
+  void release(VAO *vao)
+  {
+    gpu.freeMesh(vao->First, vao->NumVertices);
+    gpu.meshes--;
+  }
+
+  void draw(VAO *vao, const glm::mat4 &MVP)
+  {
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
-{
     // Change the Fill Mode for this object
     glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
 
-    // Bind the VAO to use
+    // Bind the VAO to use - positions and colours are set up in it already
     glBindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // Draw the geometry !
+    glDrawArrays(vao->PrimitiveMode, vao->First, vao->NumVertices);
+  }
+} gl_backend;
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+/* Layout glMultiDrawArraysIndirect reads */
+struct DrawArraysIndirectCommand {
+  GLuint count, instanceCount, first, baseInstance;
+};
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
-}
+/* A command buffer of the fast path: one vertex array reading meshes out of
+   the shared buffer (binding 0) and per-instance data (binding 1). All meshes
+   are filled triangle lists, so one call covers any mix of them. Commands and
+   instances go through the stream buffer */
+struct IndirectBatch {
+  GLuint vao;
+  vector<DrawArraysIndirectCommand> list;
+  IndirectBatch() : vao(0) {}
+
+  /* Instance attributes as { location, components, offset } */
+  void create(const GLuint (*attribs)[3], int count)
+  {
+    vao = gpu.vertexArray();
+    gpu.meshAttribs(vao);
+    for(int a=0;a<count;a++)
+    {
+      glEnableVertexArrayAttrib(vao, attribs[a][0]);
+      glVertexArrayAttribFormat(vao, attribs[a][0], attribs[a][1], GL_FLOAT, GL_FALSE, attribs[a][2]);
+      glVertexArrayAttribBinding(vao, attribs[a][0], 1);
+    }
+    glVertexArrayBindingDivisor(vao, 1, 1);
+  }
 
+  /* Draw mesh for instances [base, base+n) of what will be submitted */
+  void add(VAO *mesh, int base, int n)
+  {
+    DrawArraysIndirectCommand c = { (GLuint)mesh->NumVertices, (GLuint)n, (GLuint)mesh->First, (GLuint)base };
+    if(!list.empty() && list.back().first==c.first && list.back().count==c.count &&
+       list.back().baseInstance+list.back().instanceCount==c.baseInstance)
+      list.back().instanceCount += n;     // same mesh straight after, one command
+    else
+      list.push_back(c);
+  }
 
+  /* Upload the instances and commands and draw them all with the program in use.
+     Returns how many commands that was */
+  int submit(const void *data, long bytes, GLsizei stride)
+  {
+    if(list.empty())
+      return 0;
+    long commands = list.size()*sizeof(DrawArraysIndirectCommand);
+    long at = stream.alloc(commands+bytes);
+    stream.fill(at, &list[0], commands);
+    stream.fill(at+commands, data, bytes);
+    glVertexArrayVertexBuffer(vao, 0, gpu.mesh_buffer, 0, sizeof(MeshVertex));
+    glVertexArrayVertexBuffer(vao, 1, stream.buffer, at+commands, stride);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, stream.buffer);
+    glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)at, list.size(), 0);
+    int n = list.size();
+    list.clear();
+    return n;
+  }
+};
 
 
+/* Lock-free ring between exactly one producer thread and one consumer thread */
+/* N must be a power of two */
+template <typename T, unsigned N>
+class SpscQueue {
+  T items[N];
+  std::atomic<unsigned> head;   // next slot to read, owned by the consumer
+  std::atomic<unsigned> tail;   // next slot to write, owned by the producer
 
+public:
+  SpscQueue() : head(0), tail(0) {}
 
+  bool push(const T &item)
+  {
+    unsigned t = tail.load(std::memory_order_relaxed);
+    if(t - head.load(std::memory_order_acquire) == N)
+      return false;   // full
+    items[t & (N-1)] = item;
+    tail.store(t+1, std::memory_order_release);
+    return true;
+  }
 
-/**************************
- * Customizable functions *
- **************************/
+  bool pop(T &item)
+  {
+    unsigned h = head.load(std::memory_order_relaxed);
+    if(h == tail.load(std::memory_order_acquire))
+      return false;   // empty
+    item = items[h & (N-1)];
+    head.store(h+1, std::memory_order_release);
+    return true;
+  }
+};
 
-glm::mat4 VP,MVP;
-double last_update_time = glfwGetTime(), current_time,update_call = glfwGetTime(),change_time = glfwGetTime();
-int flag_move=0,flag_complete=0,flag_fallcomp=0,flag_fall=0,flag_stand=1,fall_call=0,fall_lvl3=0,flag_attach=1,flag_shift=0;
-int max_level=4,lvl3_x,lvl3_y;
-int var=0;
-int moves=0,timehr=0,timemin=0,timesec=0,flag_gameover=0,flag_gamestart=0,miss_limit=10,miss=0,zoom=26,v=0,flag_hover=0;
-double xpos,ypos;
 
-class Stage{
-public:
-  int stage[5][15][10],target[5][2],start[5][2];
-  int level,start_stage,end_stage;
-  int anim_i,anim_j,flag;
-  float initx,inity,zs,zs2;
-  VAO *rect1, *rect2, *circle, *rect3, *rect4, *rect5;
-  
+/* Lock-free triple buffer: one writer thread publishes whole states, one
+   reader thread picks up the newest. Neither side ever waits for the other */
+template <typename T>
+class TripleBuffer {
+  T slots[3];
+  std::atomic<int> middle;    // slot index, | 4 when it holds an unread state
+  int back;                   // writer's slot
+  int front;                  // reader's slot
+
 public:
-  Stage()
+  TripleBuffer() : middle(1), back(0), front(2) {}
+
+  T &writeBuffer() { return slots[back]; }
+  const T &readBuffer() const { return slots[front]; }
+
+  /* Hand the write buffer to the reader. Returns true if the slot given
+     back in exchange was never read (the reader fell behind) */
+  bool publish()
   {
-    level=1;
-    start_stage=1;
-    zs=-50;
-    end_stage=0;
-    flag=0;
-    initx=5;inity=5;
-    anim_i=0;
-    anim_j=0;
+    int old = middle.exchange(back | 4, std::memory_order_acq_rel);
+    back = old & 3;
+    return (old & 4) != 0;
+  }
+
+  /* Switch to the newest published state. Returns false if nothing new */
+  bool update()
+  {
+    if(!(middle.load(std::memory_order_relaxed) & 4))
+      return false;
+    int old = middle.exchange(front, std::memory_order_acq_rel);
+    front = old & 3;
+    return true;
+  }
+};
 
-    start[0][0]=1;
-    start[0][1]=6;
-    start[1][0]=1;
-    start[1][1]=3;
-    start[2][0]=1;
-    start[2][1]=3;
-    start[3][0]=1;
-    start[3][1]=4;
 
-    for(int i=0;i<15;i++)
+/****************
+ * Audio engine *
+ ****************/
+
+#define AUDIO_RATE 44100
+#define AUDIO_CHANNELS 2
+#define AUDIO_BLOCK 1024     // frames mixed per iteration (~23ms)
+#define AUDIO_VOICES 8
+
+enum { SOUND_LEVEL_UP, SOUND_ROLL, SOUND_FALL, SOUND_COUNT };
+enum { AUDIO_PLAY, AUDIO_STOP, AUDIO_QUIT };
+
+/* Decoded sound - interleaved stereo 16 bit PCM at AUDIO_RATE */
+struct SoundBuffer {
+  vector<int16_t> samples;
+  int frames;
+  SoundBuffer() : frames(0) {}
+};
+
+struct AudioCommand {
+  int op;
+  int sound;
+};
+
+/* Where the mixed PCM goes. write() blocks until the block has been consumed */
+class AudioOutput {
+public:
+  virtual ~AudioOutput() {}
+  virtual bool write(const int16_t *samples, int frames) = 0;
+};
+
+/* Output that is not backed by a device - sleeps to keep real-time pace */
+class PacedAudioOutput : public AudioOutput {
+  std::chrono::steady_clock::time_point next;
+  bool started;
+protected:
+  void pace(int frames)
+  {
+    if(!started)
     {
-      for(int j=0;j<10;j++)
-      {
-        stage[0][i][j]=0;
-        stage[1][i][j]=0;
-        stage[2][i][j]=0;
-        stage[3][i][j]=0;
-      }
+      next = std::chrono::steady_clock::now();
+      started = true;
     }
-
-    stage[0][1][7]=1;stage[0][1][6]=1;stage[0][1][5]=1;stage[0][1][4]=1;
-    stage[0][2][7]=1;stage[0][2][6]=1;stage[0][2][5]=1;stage[0][2][4]=1;
-    stage[0][3][6]=1;stage[0][3][5]=1;stage[0][3][4]=1;
-    stage[0][4][4]=1;
-    stage[0][5][4]=1;stage[0][5][3]=1;
-    stage[0][6][5]=1;stage[0][6][4]=1;stage[0][6][3]=1;stage[0][6][2]=1;
-    stage[0][7][4]=1;stage[0][7][2]=1;
-    stage[0][8][5]=1;stage[0][8][4]=1;stage[0][8][3]=1;stage[0][8][2]=1;
-    stage[0][9][4]=1;stage[0][9][2]=1;
-
-    target[0][0]=7;target[0][1]=3;
-    stage[0][7][3]=2;
-
-    stage[1][0][2]=1;stage[1][0][3]=1;stage[1][0][4]=1;stage[1][0][5]=1;stage[1][0][6]=1;
-    stage[1][1][2]=1;stage[1][1][3]=1;stage[1][1][4]=1;stage[1][1][5]=1;stage[1][1][6]=1;
-    stage[1][2][2]=1;stage[1][2][3]=1;stage[1][2][4]=1;stage[1][2][5]=3;stage[1][2][6]=1;
-    stage[1][3][2]=1;stage[1][3][3]=1;stage[1][3][4]=1;stage[1][3][5]=1;stage[1][3][6]=1;
-    stage[1][6][2]=1;stage[1][6][3]=1;stage[1][6][4]=1;stage[1][6][5]=1;stage[1][6][6]=1;stage[1][6][7]=1;
-    stage[1][7][2]=1;stage[1][7][3]=1;stage[1][7][4]=1;stage[1][7][5]=1;stage[1][7][6]=1;stage[1][7][7]=1;
-    stage[1][8][2]=1;stage[1][8][3]=1;stage[1][8][4]=1;stage[1][8][5]=1;stage[1][8][6]=4;stage[1][8][7]=1;
-    stage[1][9][2]=1;stage[1][9][3]=1;stage[1][9][4]=1;stage[1][9][5]=1;stage[1][9][6]=1;stage[1][9][7]=1;
-    stage[1][12][3]=1;stage[1][12][4]=1;stage[1][12][5]=1;stage[1][12][6]=1;stage[1][12][7]=1;
-    stage[1][13][3]=1;stage[1][13][4]=1;stage[1][13][5]=1;stage[1][13][6]=2;stage[1][13][7]=1;
-    stage[1][14][3]=1;stage[1][14][4]=1;stage[1][14][5]=1;stage[1][14][6]=1;stage[1][14][7]=1;
-
-    target[1][0]=13;target[1][1]=6;
-
-    stage[2][0][2]=1;stage[2][0][3]=1;stage[2][0][4]=1;stage[2][0][5]=1;stage[2][0][6]=1;
-    stage[2][1][2]=1;stage[2][1][3]=1;stage[2][1][4]=1;stage[2][1][5]=1;stage[2][1][6]=1;
-    stage[2][2][2]=1;stage[2][2][3]=1;stage[2][2][4]=1;stage[2][2][5]=1;stage[2][2][6]=1;
-    stage[2][3][6]=1;stage[2][3][7]=5;stage[2][3][8]=5;
-    stage[2][4][7]=5;stage[2][4][8]=5;
-    stage[2][5][0]=1;stage[2][5][1]=1;stage[2][5][2]=1;stage[2][5][3]=1;stage[2][5][7]=5;stage[2][5][8]=5;
-    stage[2][6][0]=1;stage[2][6][1]=2;stage[2][6][2]=1;stage[2][6][3]=1;stage[2][6][7]=5;stage[2][6][8]=5;
-    stage[2][7][0]=1;stage[2][7][1]=1;stage[2][7][2]=1;stage[2][7][3]=1;stage[2][7][7]=5;stage[2][7][8]=5;
-    stage[2][8][2]=1;stage[2][8][3]=1;stage[2][8][7]=5;stage[2][8][8]=5;
-    stage[2][9][2]=5;stage[2][9][3]=5;stage[2][9][6]=1;stage[2][9][7]=5;stage[2][9][8]=5;
-    stage[2][10][0]=5;stage[2][10][1]=5;stage[2][10][2]=5;stage[2][10][3]=5;stage[2][10][4]=1;stage[2][10][5]=1;stage[2][10][6]=1;
-    stage[2][11][0]=5;stage[2][11][1]=5;stage[2][11][2]=5;stage[2][11][3]=5;stage[2][11][4]=1;stage[2][11][5]=1;stage[2][11][6]=1;
-    stage[2][12][0]=5;stage[2][12][1]=1;stage[2][12][2]=5;stage[2][12][3]=5;
-    stage[2][13][0]=5;stage[2][13][1]=5;stage[2][13][2]=5;stage[2][13][3]=5;
-
-    target[2][0]=6;target[2][1]=1;
-
-    stage[3][0][3]=1;stage[3][0][4]=1;stage[3][0][5]=1;
-    stage[3][1][3]=1;stage[3][1][4]=1;stage[3][1][5]=1;
-    stage[3][2][3]=1;stage[3][2][4]=1;stage[3][2][5]=1;
-    stage[3][3][3]=1;stage[3][3][4]=1;stage[3][3][5]=1;
-    stage[3][4][3]=1;stage[3][4][4]=6;stage[3][4][5]=1;
-    stage[3][5][3]=1;stage[3][5][4]=1;stage[3][5][5]=1;
-    stage[3][9][0]=1;stage[3][9][1]=1;stage[3][9][2]=1;stage[3][9][3]=1;stage[3][9][4]=1;stage[3][9][5]=1;stage[3][9][6]=1;stage[3][9][7]=1;stage[3][9][8]=1;
-    stage[3][10][0]=1;stage[3][10][1]=1;stage[3][10][2]=1;stage[3][10][3]=1;stage[3][10][4]=1;stage[3][10][5]=1;stage[3][10][6]=1;stage[3][10][7]=1;stage[3][10][8]=1;
-    stage[3][11][0]=1;stage[3][11][1]=1;stage[3][11][2]=1;stage[3][11][3]=1;stage[3][11][4]=1;stage[3][11][5]=1;stage[3][11][6]=1;stage[3][11][7]=1;stage[3][11][8]=1;
-    stage[3][12][3]=1;stage[3][12][4]=1;stage[3][12][5]=1;
-    stage[3][13][3]=1;stage[3][13][4]=2;stage[3][13][5]=1;
-    stage[3][14][3]=1;stage[3][14][4]=1;stage[3][14][5]=1;
-
-    target[3][0]=13;target[3][1]=4;
+    next += std::chrono::microseconds((long long)frames*1000000/AUDIO_RATE);
+    std::this_thread::sleep_until(next);
   }
+public:
+  PacedAudioOutput() : started(false) {}
+};
 
-  ~Stage()
+class NullAudioOutput : public PacedAudioOutput {
+public:
+  bool write(const int16_t *, int frames)
   {
-    free(rect1);
-    free(rect2);
-    free(circle);
-    free(rect3);
-    free(rect4);
-    free(rect5);
+    pace(frames);
+    return true;
   }
+};
+
+/* Records everything that would have been played into a .wav file */
+class WavAudioOutput : public PacedAudioOutput {
+  FILE *file;
+  uint32_t data_bytes;
+
+  void put32(uint32_t v) { uint8_t b[4]={(uint8_t)v,(uint8_t)(v>>8),(uint8_t)(v>>16),(uint8_t)(v>>24)}; fwrite(b,1,4,file); }
+  void put16(uint16_t v) { uint8_t b[2]={(uint8_t)v,(uint8_t)(v>>8)}; fwrite(b,1,2,file); }
 
-  void checkTouch(int x1,int y1,int x2,int y2)
+  void writeHeader()
   {
+    fseek(file, 0, SEEK_SET);
+    fwrite("RIFF", 1, 4, file); put32(36+data_bytes);
+    fwrite("WAVEfmt ", 1, 8, file); put32(16);
+    put16(1); put16(AUDIO_CHANNELS); put32(AUDIO_RATE);
+    put32(AUDIO_RATE*AUDIO_CHANNELS*2); put16(AUDIO_CHANNELS*2); put16(16);
+    fwrite("data", 1, 4, file); put32(data_bytes);
+  }
+
+public:
+  WavAudioOutput(const char *path) : data_bytes(0)
+  {
+    file = fopen(path, "wb");
+    if(file)
+      writeHeader();
+  }
+  ~WavAudioOutput()
+  {
+    if(file)
+    {
+      writeHeader();
+      fclose(file);
+    }
+  }
+  bool ok() { return file!=NULL; }
+  bool write(const int16_t *samples, int frames)
+  {
+    // samples are already little endian on every platform we build for
+    fwrite(samples, 2*AUDIO_CHANNELS, frames, file);
+    data_bytes += frames*2*AUDIO_CHANNELS;
+    pace(frames);
+    return true;
+  }
+};
+
+/* Streams to a single long-lived aplay process, opened once at startup */
+class PipeAudioOutput : public AudioOutput {
+  FILE *pipe;
+public:
+  PipeAudioOutput()
+  {
+    pipe = popen("aplay -q -t raw -f S16_LE -r 44100 -c 2 2>/dev/null", "w");
+  }
+  ~PipeAudioOutput()
+  {
+    if(pipe)
+      pclose(pipe);
+  }
+  bool ok() { return pipe!=NULL; }
+  bool write(const int16_t *samples, int frames)
+  {
+    return fwrite(samples, 2*AUDIO_CHANNELS, frames, pipe) == (size_t)frames && fflush(pipe) == 0;
+  }
+};
+
+/* Convert 16 bit PCM of any rate / channel count to the mixer format */
+void convertSound(const int16_t *in, int in_frames, int channels, int rate, SoundBuffer &sound)
+{
+  sound.frames = (int)((long long)in_frames*AUDIO_RATE/rate);
+  sound.samples.resize(sound.frames*AUDIO_CHANNELS);
+  for(int i=0;i<sound.frames;i++)
+  {
+    // linear resampling
+    double src = (double)i*rate/AUDIO_RATE;
+    int s0 = (int)src;
+    int s1 = s0+1<in_frames ? s0+1 : s0;
+    double f = src-s0;
+    for(int c=0;c<AUDIO_CHANNELS;c++)
+    {
+      int ch = c<channels ? c : channels-1;
+      sound.samples[i*AUDIO_CHANNELS+c] = (int16_t)((1-f)*in[s0*channels+ch] + f*in[s1*channels+ch]);
+    }
+  }
+}
+
+bool loadWav(const char *path, SoundBuffer &sound)
+{
+  std::ifstream stream(path, std::ios::in | std::ios::binary);
+  if(!stream.is_open())
+    return false;
+  vector<char> data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+  if(data.size()<12 || memcmp(&data[0],"RIFF",4) || memcmp(&data[8],"WAVE",4))
+    return false;
+
+  int channels=0, rate=0, bits=0, format=0;
+  size_t pos=12;
+  while(pos+8<=data.size())
+  {
+    uint32_t size;
+    memcpy(&size, &data[pos+4], 4);
+    const char *body = &data[pos+8];
+    if(pos+8+size>data.size())
+      size = data.size()-pos-8;
+    if(!memcmp(&data[pos],"fmt ",4) && size>=16)
+    {
+      uint16_t v16; uint32_t v32;
+      memcpy(&v16, body, 2); format=v16;
+      memcpy(&v16, body+2, 2); channels=v16;
+      memcpy(&v32, body+4, 4); rate=v32;
+      memcpy(&v16, body+14, 2); bits=v16;
+    }
+    else if(!memcmp(&data[pos],"data",4))
+    {
+      if(format!=1 || bits!=16 || channels<1 || rate<=0)
+      {
+        fprintf(stderr, "Audio: %s is not 16 bit PCM\n", path);
+        return false;
+      }
+      vector<int16_t> pcm(size/2);
+      memcpy(&pcm[0], body, pcm.size()*2);
+      convertSound(&pcm[0], pcm.size()/channels, channels, rate, sound);
+      return true;
+    }
+    pos += 8+size+(size&1);
+  }
+  return false;
+}
+
+/* No in-tree mp3 decoder - let mpg123 decode the whole file to raw PCM, once */
+bool loadMp3(const char *path, SoundBuffer &sound)
+{
+  std::ifstream probe(path);
+  if(!probe.is_open())
+    return false;
+  probe.close();
+
+  string cmd = string("mpg123 -q -s -r 44100 --stereo -e s16 \"") + path + "\" 2>/dev/null";
+  FILE *pipe = popen(cmd.c_str(), "r");
+  if(!pipe)
+    return false;
+  vector<int16_t> pcm;
+  int16_t buffer[4096];
+  size_t n;
+  while((n = fread(buffer, 2, 4096, pipe)) > 0)
+    pcm.insert(pcm.end(), buffer, buffer+n);
+  pclose(pipe);
+  if(pcm.size()<2)
+    return false;
+  convertSound(&pcm[0], pcm.size()/2, 2, AUDIO_RATE, sound);
+  return true;
+}
+
+/* Looks for <name>.wav first, then <name>.mp3 */
+bool loadSound(const char *name, SoundBuffer &sound)
+{
+  string base(name);
+  return loadWav((base+".wav").c_str(), sound) || loadMp3((base+".mp3").c_str(), sound);
+}
+
+class AudioEngine {
+  SoundBuffer sounds[SOUND_COUNT];
+  SpscQueue<AudioCommand, 64> commands;   // game thread -> audio thread
+  AudioOutput *output;
+  std::thread worker;
+  bool running;
+
+  void run()
+  {
+    int voice_sound[AUDIO_VOICES], voice_pos[AUDIO_VOICES];
+    int32_t mix[AUDIO_BLOCK*AUDIO_CHANNELS];
+    int16_t block[AUDIO_BLOCK*AUDIO_CHANNELS];
+    for(int i=0;i<AUDIO_VOICES;i++)
+      voice_sound[i]=-1;
+
+    while(1)
+    {
+      AudioCommand cmd;
+      while(commands.pop(cmd))
+      {
+        if(cmd.op==AUDIO_QUIT)
+          return;
+        else if(cmd.op==AUDIO_STOP)
+        {
+          for(int i=0;i<AUDIO_VOICES;i++)
+            voice_sound[i]=-1;
+        }
+        else if(cmd.op==AUDIO_PLAY && sounds[cmd.sound].frames>0)
+        {
+          // take a free voice, or steal the one closest to finishing
+          int slot=0;
+          for(int i=0;i<AUDIO_VOICES;i++)
+          {
+            if(voice_sound[i]==-1)
+            {
+              slot=i;
+              break;
+            }
+            if(voice_pos[i]>voice_pos[slot])
+              slot=i;
+          }
+          voice_sound[slot]=cmd.sound;
+          voice_pos[slot]=0;
+        }
+      }
+
+      memset(mix, 0, sizeof(mix));
+      for(int i=0;i<AUDIO_VOICES;i++)
+      {
+        if(voice_sound[i]==-1)
+          continue;
+        SoundBuffer &sound = sounds[voice_sound[i]];
+        int n = min(AUDIO_BLOCK, sound.frames-voice_pos[i]);
+        const int16_t *src = &sound.samples[voice_pos[i]*AUDIO_CHANNELS];
+        for(int s=0;s<n*AUDIO_CHANNELS;s++)
+          mix[s] += src[s];
+        voice_pos[i] += n;
+        if(voice_pos[i]>=sound.frames)
+          voice_sound[i]=-1;
+      }
+      for(int s=0;s<AUDIO_BLOCK*AUDIO_CHANNELS;s++)
+        block[s] = (int16_t)max(-32768, min(32767, mix[s]));
+
+      if(!output->write(block, AUDIO_BLOCK))
+      {
+        fprintf(stderr, "Audio: output device failed, continuing without sound\n");
+        delete output;
+        output = new NullAudioOutput;
+      }
+    }
+  }
+
+public:
+  AudioEngine() : output(NULL), running(false) {}
+
+  /* backend is "device", "null" or "wav:<file>". Decodes the sounds, so main
+     runs it on a worker thread while the window comes up */
+  void init(const char *backend)
+  {
+    // a dead aplay must not kill the game
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *names[SOUND_COUNT] = { "level_up", "roll", "fall" };
+    for(int i=0;i<SOUND_COUNT;i++)
+      loadSound(names[i], sounds[i]);
+    if(sounds[SOUND_LEVEL_UP].frames==0)
+      fprintf(stderr, "Audio: could not decode level_up sound\n");
+
+    if(!strncmp(backend, "wav:", 4))
+    {
+      WavAudioOutput *wav = new WavAudioOutput(backend+4);
+      if(wav->ok())
+        output = wav;
+      else
+      {
+        fprintf(stderr, "Audio: cannot write %s\n", backend+4);
+        delete wav;
+      }
+    }
+    else if(!strcmp(backend, "device"))
+    {
+      PipeAudioOutput *pipe = new PipeAudioOutput;
+      if(pipe->ok())
+        output = pipe;
+      else
+        delete pipe;
+    }
+    if(output==NULL)
+      output = new NullAudioOutput;
+
+    running = true;
+    worker = std::thread(&AudioEngine::run, this);
+  }
+
+  /* Only ever called from the game thread */
+  void play(int sound)
+  {
+    AudioCommand cmd = { AUDIO_PLAY, sound };
+    if(running)
+      commands.push(cmd);
+  }
+
+  void shutdown()
+  {
+    if(!running)
+      return;
+    AudioCommand cmd = { AUDIO_QUIT, 0 };
+    while(!commands.push(cmd))
+      std::this_thread::yield();
+    worker.join();
+    delete output;
+    output = NULL;
+    running = false;
+  }
+} audio;
+
+
+
+
+
+
+
+/**************************
+ * Customizable functions *
+ **************************/
+
+glm::mat4 VP;
+double last_update_time = glfwGetTime(), current_time,update_call = glfwGetTime(),change_time = glfwGetTime();
+int flag_move=0,flag_complete=0,flag_fallcomp=0,flag_fall=0,flag_stand=1,fall_call=0,flag_attach=1,flag_shift=0;
+int max_level=LEVELS;
+int var=0;
+int moves=0,timehr=0,timemin=0,timesec=0,flag_gameover=0,flag_gamestart=0,miss_limit=10,miss=0,zoom=26,v=0,flag_hover=0;
+double xpos,ypos;
+int headless=0;     // hidden window driven by scripted input
+
+enum { HUD_NONE, HUD_GAME, HUD_GAMEOVER };
+enum { WAVE_NONE, WAVE_RISE, WAVE_SINK };     // stage intro / outro
+
+struct AppliedInput {
+  double input;       // callback fired
+  double applied;     // simulation acted on it
+};
+
+/* Everything the render thread needs to draw one frame. Written by the
+   simulation thread, never modified once published */
+struct FrameState {
+  bool valid;
+  glm::mat4 VP;
+  vector<TileDraw> tiles;
+  vector<CubeDraw> cubes;
+  bool ortho;                     // one of the orthographic cameras (v 0-2)
+  int wave_mode;                  // stage wave applied to the tiles on the GPU
+  float wave_zs;
+  int hud, moves, misses_left, level, timemin, timesec;
+  vector<AppliedInput> inputs;    // took effect since the previous published state
+  uint64_t scene_signature;
+  FrameState() : valid(false), ortho(true), wave_mode(WAVE_NONE), wave_zs(0), hud(HUD_NONE), scene_signature(0) {}
+
+  /* FNV-1a over the 3D part: camera, stage wave, tiles and cubes */
+  uint64_t sceneSignature() const
+  {
+    uint64_t h = 14695981039346656037ULL;
+    hashBytes(h, &VP, sizeof(VP));
+    hashBytes(h, &wave_mode, sizeof(wave_mode));
+    hashBytes(h, &wave_zs, sizeof(wave_zs));
+    if(!tiles.empty())
+      hashBytes(h, &tiles[0], tiles.size()*sizeof(TileDraw));
+    if(!cubes.empty())
+      hashBytes(h, &cubes[0], cubes.size()*sizeof(CubeDraw));
+    return h;
+  }
+
+  /* ... and everything else that ends up on screen */
+  uint64_t signature() const
+  {
+    uint64_t h = scene_signature;
+    int hud_values[6] = { hud, moves, misses_left, level, timemin, timesec };
+    hashBytes(h, hud_values, sizeof(hud_values));
+    return h;
+  }
+
+  static void hashBytes(uint64_t &h, const void *data, size_t n)
+  {
+    const unsigned char *p = (const unsigned char *)data;
+    for(size_t i=0;i<n;i++)
+      h = (h ^ p[i]) * 1099511628211ULL;
+  }
+};
+
+TripleBuffer<FrameState> frames;
+FrameState *sim_frame;        // state being built by the current simulation tick
+std::atomic<bool> sim_running(false);
+std::atomic<double> cursor_x(0), cursor_y(0);   // cursor in HUD coordinates, from the render thread
+int force_redraw=1;           // render thread: window contents were lost
+int fb_width=800, fb_height=700;
+
+/* Render thread counters, printed at exit with --stats */
+struct RenderStats {
+  bool enabled;
+  long frames;              // frames presented
+  long scene_passes;        // frames that rasterised any of the 3D scene
+  long partial_passes;      // ... through dirty rectangles only
+  vector<float> touched;    // fraction of scene pixels redrawn, per frame
+  long disc_triangles;      // switch / teleport disc triangles drawn
+  long disc_triangles_full; // ... had they all been at full detail
+  long tile_triangles;      // stage triangles submitted
+  long tile_triangles_all;  // ... with every wall and bottom drawn
+  long tiles_drawn;         // tiles kept by the perspective frustum test
+  long tiles_culled;        // ... and dropped
+  long slab_quads_culled;   // merged stage quads dropped
+  long draw_calls;          // glDraw* calls for tiles, cubes and the HUD
+  long draw_commands;       // ... and the meshes they drew, more than one per call on the fast path
+  long transforms_updated;  // HUD world matrices recomputed
+  long transforms_reused;   // ... and kept from the frame before
+
+  RenderStats() : enabled(false), frames(0), scene_passes(0), partial_passes(0), disc_triangles(0), disc_triangles_full(0),
+                  tile_triangles(0), tile_triangles_all(0), tiles_drawn(0), tiles_culled(0), slab_quads_culled(0),
+                  draw_calls(0), draw_commands(0), transforms_updated(0), transforms_reused(0) {}
+
+  void drew(int commands)
+  {
+    if(commands>0)
+    {
+      draw_calls++;
+      draw_commands += commands;
+    }
+  }
+
+  void report()
+  {
+    if(!enabled || frames==0)
+      return;
+    vector<float> t = touched;
+    sort(t.begin(), t.end());
+    double sum=0;
+    for(size_t i=0;i<t.size();i++)
+      sum+=t[i];
+    printf("Render: %ld frames, %ld scene passes (%ld partial)\n", frames, scene_passes, partial_passes);
+    if(!t.empty())
+      printf("  scene pixels touched per frame: mean %.3f  p50 %.3f  p90 %.3f  max %.3f\n",
+             sum/t.size(), t[t.size()/2], t[t.size()*9/10], t.back());
+    if(tile_triangles_all>0)
+      printf("  stage: %ld triangles submitted, %ld without hidden-face removal (%.1f%%)\n", tile_triangles,
+             tile_triangles_all, 100.0*tile_triangles/tile_triangles_all);
+    if(tiles_drawn+tiles_culled>0)
+      printf("  frustum culling: %ld tiles drawn, %ld culled (%.1f%%), %ld merged quads culled\n", tiles_drawn,
+             tiles_culled, 100.0*tiles_culled/(tiles_drawn+tiles_culled), slab_quads_culled);
+    if(draw_calls>0)
+      printf("  %s path: %ld draw calls for %ld meshes, %.1f per frame\n", fast_path ? "GL 4.5" : "GL 3.3",
+             draw_calls, draw_commands, (double)draw_calls/frames);
+    if(transforms_updated+transforms_reused>0)
+      printf("  HUD transforms: %ld recomputed, %ld reused (%.1f%%)\n", transforms_updated, transforms_reused,
+             100.0*transforms_reused/(transforms_updated+transforms_reused));
+    if(disc_triangles_full>0)
+      printf("  switch discs: %ld triangles drawn, %ld at full detail (%.1f%%)\n", disc_triangles,
+             disc_triangles_full, 100.0*disc_triangles/disc_triangles_full);
+  }
+} render_stats;
+
+/* Tiles that have left the level grid, like a fragile tile dropping away under
+   the block, as parallel component arrays. Any number can be in flight and an
+   animation tick is one pass over the arrays. While a cell has live entities
+   its tile is not drawn from the level layout */
+#define FALL_FLOOR -55        // entities below this are gone
+
+struct TileEntities {
+  vector<short> i, j;         // grid cell
+  vector<float> z, vz;        // height off the stage, and its change per animation tick
+  vector<unsigned char> type; // tile type, as in Stage::stage
+  unsigned char live[15][10]; // entities per cell
+
+  TileEntities() { clear(); }
+
+  int size() const { return z.size(); }
+
+  void spawn(int ci, int cj, int t, float speed)
+  {
+    i.push_back(ci);
+    j.push_back(cj);
+    z.push_back(0);
+    vz.push_back(speed);
+    type.push_back(t);
+    live[ci][cj]++;
+  }
+
+  void step()
+  {
+    int n = size();
+    for(int k=0;k<n;k++)
+      z[k] += vz[k];
+  }
+
+  /* Drop the entities that fell out of sight, keeping the order of the rest */
+  void expire()
+  {
+    int n = size(), kept = 0;
+    for(int k=0;k<n;k++)
+    {
+      if(z[k]<FALL_FLOOR)
+      {
+        live[i[k]][j[k]]--;
+        continue;
+      }
+      i[kept] = i[k];
+      j[kept] = j[k];
+      z[kept] = z[k];
+      vz[kept] = vz[k];
+      type[kept] = type[k];
+      kept++;
+    }
+    i.resize(kept);
+    j.resize(kept);
+    z.resize(kept);
+    vz.resize(kept);
+    type.resize(kept);
+  }
+
+  void clear()
+  {
+    i.clear();
+    j.clear();
+    z.clear();
+    vz.clear();
+    type.clear();
+    memset(live, 0, sizeof(live));
+  }
+} tile_entities;
+
+class Stage : public Levels{
+public:
+  int level,start_stage,end_stage;
+  int anim_i,anim_j,flag;
+  float initx,inity,zs;
+  VAO *rect1, *rect2, *circle, *rect3, *rect4, *rect5;
+  VAO *rect2m, *rect5m;   // rect2 and rect5 mirrored in y, for the -y and +x walls
+  VAO *circle_lod[CIRCLE_LODS];
+  
+public:
+  Stage()
+  {
+    level=1;
+    start_stage=1;
+    zs=-50;
+    end_stage=0;
+    flag=0;
+    initx=5;inity=5;
+    anim_i=0;
+    anim_j=0;
+  }
+
+  ~Stage()
+  {
+    destroy3DObject(rect1);
+    destroy3DObject(rect2);
+    for(int i=0;i<CIRCLE_LODS-1;i++)
+      destroy3DObject(circle_lod[i]);
+    destroy3DObject(circle);
+    destroy3DObject(rect3);
+    destroy3DObject(rect4);
+    destroy3DObject(rect5);
+    destroy3DObject(rect2m);
+    destroy3DObject(rect5m);
+  }
+
+  /* The n cells x[], y[] of the group that just moved */
+  void checkTouch(const int *x,const int *y,int n)
+  {
+  	int x1=x[0],y1=y[0];
+  	bool on_switch=false,on_heavy=false;
+  	for(int c=0;c<n;c++)
+  	{
+  		on_switch = on_switch || (x[c]==2 && y[c]==5);
+  		on_heavy = on_heavy || (x[c]==8 && y[c]==6);
+  	}
   	if(level==2)
   	{
-  		if((x1==2 && y1==5) || (x2==2 && y2==5))
+  		if(on_switch)
   		{
   			stage[1][4][3]=(stage[1][4][3]+1)%2;
   			stage[1][5][3]=(stage[1][5][3]+1)%2;
   		}
-  		if((x1==8 && y1==6) || (x2==8 && y2==6))
+  		if(on_heavy)
   		{
   			if(flag_stand==1)
   			{
@@ -353,10 +1443,7 @@ public:
   			{
   				flag_fall=1;
   				miss++;
-  				fall_lvl3=1;
-  				lvl3_x=x1;
-  				lvl3_y=y1;
-  				zs2=0;
+  				tile_entities.spawn(x1,y1,stage[2][x1][y1],-5);
   			}
   		}
   		
@@ -377,341 +1464,64 @@ public:
 
   void createStage1()
   {
-    static const GLfloat vertex_buffer_data [] = {
-      -5,-5,0, // vertex 1
-      -5,5,0, // vertex 2
-      0,0,0, // vertex 3
-
-      -5,5,0,
-      5,5,0,
-      0,0,0,
-
-      5,5,0,
-      5,-5,0,
-      0,0,0,
-
-      5,-5,0, // vertex 3
-      -5,-5,0, // vertex 4
-      0,0,0,  // vertex 1
-      };
-
-      static const GLfloat color_buffer_data [] = {
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      };
-
-      static const GLfloat color_buffer_data1 [] = {
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      };
-
-    rect1 = create3DObject(GL_TRIANGLES, 12, vertex_buffer_data, color_buffer_data, GL_FILL);
-    rect4 = create3DObject(GL_TRIANGLES, 12, vertex_buffer_data, color_buffer_data1, GL_FILL);
-
+    rect1 = createStaticMesh(tile_top);
+    rect4 = createStaticMesh(tile_top_fragile);
   }
   void createStage2()
   {
-    static const GLfloat vertex_buffer_data [] ={
-      -5,0,-1,
-      -5,0,1,
-      0,0,0,
-
-      -5,0,1,
-      5,0,1,
-      0,0,0,
-
-      5,0,1,
-      5,0,-1,
-      0,0,0,
-
-      5,0,-1,
-      -5,0,-1,
-      0,0,0,
-
-    };
-
-    static const GLfloat color_buffer_data [] = {
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-
-      0.6,0.6,0.6, // color 1
-      0.6,0.6,0.6, // color 2
-      0.8,0.8,0.8, // color 3
-    };
-
-      static const GLfloat color_buffer_data1 [] = {
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-
-      0.8,0.30,0.11, // color 1
-      0.8,0.30,0.11, // color 1
-      1,0.50,0.31, // color 1
-      };
-
-    rect2 = create3DObject(GL_TRIANGLES,6,vertex_buffer_data,color_buffer_data,GL_FILL);
-    rect5 = create3DObject(GL_TRIANGLES,6,vertex_buffer_data,color_buffer_data1,GL_FILL);
+    rect2 = createStaticMesh(tile_wall);
+    rect5 = createStaticMesh(tile_wall_fragile);
+    rect2m = createStaticMesh(tile_wall_mirrored);
+    rect5m = createStaticMesh(tile_wall_mirrored_fragile);
   }
   void createRectangle()
   {
-  	static const GLfloat vertex_buffer_data [] = {
-  		-4.5+1,-4.5-1,0,
-  		-4.5-1,-4.5+1,0,
-  		4.5-1,4.5+1,0,
-
-  		4.5-1,4.5+1,0,
-  		4.5+1,4.5-1,0,
-  		-4.5+1,-4.5-1,0,
-  	};
-
-  	static const GLfloat color_buffer_data [] = {
-  		0,0,0,
-  		0,0,0,
-  		0,0,0,
-
-  		0,0,0,
-  		0,0,0,
-  		0,0,0,
-  	};
-  	rect3 = create3DObject(GL_TRIANGLES,6,vertex_buffer_data,color_buffer_data,GL_FILL);
+  	rect3 = createStaticMesh(tile_cross);
   }
+  /* Every level of detail of the half disc, circle is the full 180 segment one */
   void createCircle()
   {
-  	static GLfloat vertex_buffer_data[180*9];
-  	static GLfloat color_buffer_data[180*9];
-
-  	for(int i=0;i<180;i++)
-  	{
-  		vertex_buffer_data[9*i+0]=0;
-  		vertex_buffer_data[9*i+1]=0;
-  		vertex_buffer_data[9*i+2]=0;
-
-  		vertex_buffer_data[9*i+3]=4.5*cos(i*M_PI/180);
-  		vertex_buffer_data[9*i+4]=4.5*sin(i*M_PI/180);
-  		vertex_buffer_data[9*i+5]=0;
-
-  		vertex_buffer_data[9*i+6]=4.5*cos((i+1)*M_PI/180);
-  		vertex_buffer_data[9*i+7]=4.5*sin((i+1)*M_PI/180);
-  		vertex_buffer_data[9*i+8]=0;
-  	}
-
-  	for(int i=0;i<180;i++)
-  	{
-  		color_buffer_data[9*i+0]=0;
-  		color_buffer_data[9*i+1]=0;
-  		color_buffer_data[9*i+2]=0;
-
-  		color_buffer_data[9*i+3]=0;
-  		color_buffer_data[9*i+4]=0;
-  		color_buffer_data[9*i+5]=0;
-
-  		color_buffer_data[9*i+6]=0;
-  		color_buffer_data[9*i+7]=0;
-  		color_buffer_data[9*i+8]=0;
-
-  	}
-
-  	circle = create3DObject(GL_TRIANGLES,180*3,vertex_buffer_data,color_buffer_data,GL_FILL);
-
+  	circle_lod[0] = createStaticMesh(half_disc_16);
+  	circle_lod[1] = createStaticMesh(half_disc_32);
+  	circle_lod[2] = createStaticMesh(half_disc_64);
+  	circle_lod[3] = createStaticMesh(half_disc_180);
+  	circle = circle_lod[CIRCLE_LODS-1];
   }
 
-  void drawStage(float x1,float y1,float z1,int type)
+  /* Record the tile at cell i,j for the frame being simulated, drawn later by renderTiles().
+     Unless wave is 0 its height is left to the stage wave */
+  void drawStage(int i,int j,float z1,int type,int wave)
   {
-
-    glm::mat4 translateNet = glm::translate(glm::vec3(x1,y1,z1));
-
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translateRectangle = glm::translate (glm::vec3(0, 0, 3));        // glTranslatef
-    glm::mat4 rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    if(type==5)
-	    draw3DObject(rect4);
-	else
-    	draw3DObject(rect1);
-
-    Matrices.model = glm::mat4(1.0f);
-    translateRectangle = glm::translate (glm::vec3(0, 0, 1));        // glTranslatef
-    rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    if(type==5)
-	    draw3DObject(rect4);
-	else
-    	draw3DObject(rect1);
-
-    Matrices.model = glm::mat4(1.0f);
-    translateRectangle = glm::translate (glm::vec3(0, -5, 2));        // glTranslatef
-    rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    if(type==5)
-	    draw3DObject(rect5);
-	else
-    	draw3DObject(rect2);
-
-    Matrices.model = glm::mat4(1.0f);
-    translateRectangle = glm::translate (glm::vec3(0, 5, 2));        // glTranslatef
-    rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);  
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    if(type==5)
-	    draw3DObject(rect5);
-	else
-    	draw3DObject(rect2);
-
-    Matrices.model = glm::mat4(1.0f);
-    translateRectangle = glm::translate (glm::vec3(-5, 0, 2));        // glTranslatef
-    rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    if(type==5)
-	    draw3DObject(rect5);
-	else
-    	draw3DObject(rect2);
-
-    Matrices.model = glm::mat4(1.0f);
-    translateRectangle = glm::translate (glm::vec3(5, 0, 2));        // glTranslatef
-    rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    if(type==5)
-	    draw3DObject(rect5);
-	else
-    	draw3DObject(rect2);
-
-    if(type==3)
-    {
-	    Matrices.model = glm::mat4(1.0f);
-	    translateRectangle = glm::translate (glm::vec3(0, 0, 3.2));        // glTranslatef
-	    rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-	    MVP = VP * Matrices.model;
-	    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	    draw3DObject(circle);
-	    Matrices.model = glm::mat4(1.0f);
-	    translateRectangle = glm::translate (glm::vec3(0, 0, 3.2));        // glTranslatef
-	    rotateRectangle = glm::rotate((float)(180*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-	    MVP = VP * Matrices.model;
-	    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	    draw3DObject(circle);
-
-    }
-
-    if(type==4)
-    {
-	    Matrices.model = glm::mat4(1.0f);
-	    translateRectangle = glm::translate (glm::vec3(0, 0, 3.2));        // glTranslatef
-	    rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-	    MVP = VP * Matrices.model;
-	    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	    draw3DObject(rect3);
-
-	    Matrices.model = glm::mat4(1.0f);
-	    translateRectangle = glm::translate (glm::vec3(0, 0, 3.2));        // glTranslatef
-	    rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-	    MVP = VP * Matrices.model;
-	    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	    draw3DObject(rect3);
-
-    }
-    if(type==6)
-    {
-	    Matrices.model = glm::mat4(1.0f);
-	    translateRectangle = glm::translate (glm::vec3(-1, 0, 3.2));        // glTranslatef
-	    rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-	    MVP = VP * Matrices.model;
-	    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	    draw3DObject(circle);
-	    Matrices.model = glm::mat4(1.0f);
-	    translateRectangle = glm::translate (glm::vec3(1, 0, 3.2));        // glTranslatef
-	    rotateRectangle = glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	    Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-	    MVP = VP * Matrices.model;
-	    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	    draw3DObject(circle);
-
-    }
+    TileDraw tile = { initx+(i-8)*10, inity+(j-5)*10, z1, type, (float)i, (float)j, (float)wave };
+    sim_frame->tiles.push_back(tile);
   }
 
   void animateStage()
   {
+    // the per-tile rise-in / sink-out offsets are evaluated in Tile_GL.vert
+    if(start_stage==1)
+      sim_frame->wave_mode = WAVE_RISE;
+    else if(end_stage==1 && flag_complete==0)
+      sim_frame->wave_mode = WAVE_SINK;
+    else
+      sim_frame->wave_mode = WAVE_NONE;
+    sim_frame->wave_zs = zs;
+
+    // loose tiles first, with their own heights
+    TileEntities &loose = tile_entities;
+    loose.expire();
+    for(int k=0;k<loose.size();k++)
+      drawStage(loose.i[k],loose.j[k],loose.z[k],loose.type[k],0);
+    if(fall_call==1)
+      loose.step();
+
     for(int i=0;i<15;i++)
     {
       for(int j=0;j<10;j++)
       {
         if(stage[level-1][i][j]==1|| stage[level-1][i][j]==3|| stage[level-1][i][j]==4 || stage[level-1][i][j]==5 || stage[level-1][i][j]==6)
         {
-        if ((lvl3_x==i && lvl3_y==j) && fall_lvl3==1)
-        {
-          if(zs2<-55)
-          {
-          	fall_lvl3=0;
-          	zs2=0;
-          	continue;
-          }
-          	drawStage(initx+(i-8)*10,inity+(j-5)*10,zs2,stage[level-1][i][j]);
-          if(fall_call==1)
-          {
-          zs2-=5;
-          }	
-        }
-        else
+        if (loose.live[i][j]==0)
         {
           if(start_stage==1)
           {
@@ -719,30 +1529,8 @@ public:
     			flag++;
 	    	if(flag<7)
     			return;
-
-          	if(zs+2*i+3*j>0)
-          	{
-	          	drawStage(initx+(i-8)*10,inity+(j-5)*10,0,stage[level-1][i][j]);
-          	}
-          	else
-	          	drawStage(initx+(i-8)*10,inity+(j-5)*10,zs+2*i+3*j,stage[level-1][i][j]);
-
-          }
-          else if(end_stage==1 && flag_complete==0)
-          {
-
-          	if(zs-2*(14-i)-3*(9-j)<-90)
-          	{
-	          	drawStage(initx+(i-8)*10,inity+(j-5)*10,-100,stage[level-1][i][j]);
-          	}
-          	else
-	          	drawStage(initx+(i-8)*10,inity+(j-5)*10,zs-2*(14-i)-3*(9-j),stage[level-1][i][j]);
-
-          }
-          else
-          {
-          	drawStage(initx+(i-8)*10,inity+(j-5)*10,zs,stage[level-1][i][j]);
           }
+          drawStage(i,j,0,stage[level-1][i][j],1);
         }
        }
       }
@@ -770,7 +1558,7 @@ public:
     {
       if(flag_complete==1)
       {
-      system("mpg123 -vC level_up.mp3 &");
+      audio.play(SOUND_LEVEL_UP);
 
   		if(level<max_level)
   			level++;
@@ -786,7 +1574,7 @@ public:
         flag=0;
         end_stage=0;
         flag_complete=0;
-        fall_lvl3=0;
+        tile_entities.clear();
       }
       else
       {
@@ -815,427 +1603,260 @@ public:
 }stage;
 
 
+/* The block's cubes as pieces in parallel arrays. Pieces that touch form a
+   group, and a group rolls as one body over the edge it tips across. While
+   every piece is in one group the block is attached; a teleport splits it
+   to the level's split cells, one group per cube, and flag_blockOpt picks
+   the piece whose group moves until they touch again */
+enum { LIFT_NONE, LIFT_ALL, LIFT_FALLING };   // which pieces drawPieces() drops by zs1
+
 class Block{
 public:
-  int cube1i,cube1j,cube1k,cube2i,cube2j,cube2k,zs1,zs2,flag_check,flag_blockOpt,flag_animate,type;
+  int piece_i[BLOCK_PIECES],piece_j[BLOCK_PIECES],piece_k[BLOCK_PIECES];   // cell, and 10 per cube below it
+  int group[BLOCK_PIECES];    // lowest piece of the group each piece belongs to
+  int pieces;
+  int zs1,zs2,flag_check,flag_blockOpt,flag_animate,type;
   VAO *cube;
-  glm::mat4 animate;
+  glm::vec3 pivot, axis;    // edge the block is rolling over
+  float angle;
   int move_flag;
 
 public:
 
   Block()
   {
-    cube1i=1;
-    cube1j=6;
-    cube1k=0;
+    pieces=2;
+    piece_i[0]=1;
+    piece_j[0]=6;
+    piece_k[0]=0;
     zs1=0;
     zs2=0;
-    cube2i=1;
-    cube2j=6;
-    cube2k=10;
+    piece_i[1]=1;
+    piece_j[1]=6;
+    piece_k[1]=10;
+    group[0]=group[1]=0;
     flag_attach=1;
     type=0;
     flag_animate=0;
     flag_check=0;
     move_flag=0;
     flag_blockOpt=0;
+    angle=0;
   }
   ~Block()
   {
-    free(cube);
+    destroy3DObject(cube);
   }
 
   void createSquare ()
   {
-  // GL3 accepts only Triangles. Quads are not supported
-      static const GLfloat vertex_buffer_data [] = {
-      -5,-5,0, // vertex 1
-      -5,5,0, // vertex 2
-      0,0,0, // vertex 3
-
-      -5,5,0,
-      5,5,0,
-      0,0,0,
+  // create3DObject creates and returns a handle to a VAO that can be used later
+      cube =  createStaticMesh(cube_mesh);
+  }
 
-      5,5,0,
-      5,-5,0,
-      0,0,0,
+  /* Record a cube for the frame being simulated, drawn later by renderCubes().
+     The roll is applied in Cube_GL.vert */
+  void drawCube(float x1,float y1,float z1,int number)
+  {
+    CubeDraw c = { x1, y1, z1, { 0, 0, 1 }, 0, { 0, 0, 0 } };
+    if(flag_animate==1 && group[number]==group[flag_blockOpt])
+    {
+      c.axis[0]=axis.x; c.axis[1]=axis.y; c.axis[2]=axis.z;
+      c.angle=angle;
+      c.pivot[0]=pivot.x; c.pivot[1]=pivot.y; c.pivot[2]=pivot.z;
+    }
+    sim_frame->cubes.push_back(c);
+  }
 
-      5,-5,0, // vertex 3
-      -5,-5,0, // vertex 4
-      0,0,0,  // vertex 1
-      };
+  /* Every piece goes into the frame's one instanced cube draw. LIFT_FALLING
+     drops only the selected group, which is the whole block when attached */
+  void drawPieces(int lift)
+  {
+    for(int p=0;p<pieces;p++)
+    {
+      int z=piece_k[p];
+      if(lift==LIFT_ALL || (lift==LIFT_FALLING && group[p]==group[flag_blockOpt]))
+        z+=zs1;
+      drawCube(5+(piece_i[p]-8)*10,5+(piece_j[p]-5)*10,z,p);
+    }
+  }
 
-      static const GLfloat color_buffer_data [] = {
-      102.0/255,0.0/255,0.0/255,
-      102.0/255,0.0/255,0.0/255,
-      178.0/255,34.0/255,34.0/255,
+  bool offGrid(int p)
+  {
+    return piece_i[p]<0 || piece_i[p]>14 || piece_j[p]<0 || piece_j[p]>9;
+  }
 
-      102.0/255,0.0/255,0.0/255,
-      102.0/255,0.0/255,0.0/255,
-      178.0/255,34.0/255,34.0/255,
+  bool unsupported(int p)
+  {
+    return offGrid(p) || stage.stage[stage.level-1][piece_i[p]][piece_j[p]]==0;
+  }
 
-      102.0/255,0.0/255,0.0/255,
-      102.0/255,0.0/255,0.0/255,
-      178.0/255,34.0/255,34.0/255,
+  /* Cells group g covers */
+  void bounds(int g,int &i0,int &i1,int &j0,int &j1)
+  {
+    i0=j0=INT_MAX;
+    i1=j1=INT_MIN;
+    for(int p=0;p<pieces;p++)
+      if(group[p]==g)
+      {
+        i0=min(i0,piece_i[p]); i1=max(i1,piece_i[p]);
+        j0=min(j0,piece_j[p]); j1=max(j1,piece_j[p]);
+      }
+  }
 
-      102.0/255,0.0/255,0.0/255,
-      102.0/255,0.0/255,0.0/255,
-      178.0/255,34.0/255,34.0/255,
+  /* More than one cube, all in one cell */
+  bool column(int g)
+  {
+    int i0,i1,j0,j1,n=0;
+    bounds(g,i0,i1,j0,j1);
+    for(int p=0;p<pieces;p++)
+      n+=group[p]==g;
+    return n>1 && i0==i1 && j0==j1;
+  }
 
-      };
+  /* Where piece p of group g (bounds i0..j1) lands when the group tips over
+     its bottom edge in direction dir, as in move_flag. Groups rest on the
+     ground, so the cubes k/10 up swing out to k/10 past the edge */
+  void rolled(int p,int dir,int i0,int i1,int j0,int j1,int &i,int &j,int &k)
+  {
+    int pi=piece_i[p], pj=piece_j[p], h=piece_k[p]/10;   // i, j, k may be piece p's own
+    i=pi; j=pj;
+    if(dir==1)      { i=i0-1-h; k=(pi-i0)*10; }
+    else if(dir==2) { i=i1+1+h; k=(i1-pi)*10; }
+    else if(dir==3) { j=j1+1+h; k=(j1-pj)*10; }
+    else            { j=j0-1-h; k=(pj-j0)*10; }
+  }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-      cube =  create3DObject(GL_TRIANGLES, 12, vertex_buffer_data, color_buffer_data, GL_FILL);
+  /* The selected group can tip over in direction dir without landing in another one */
+  bool canRoll(int dir)
+  {
+    int g=group[flag_blockOpt],i0,i1,j0,j1;
+    bounds(g,i0,i1,j0,j1);
+    for(int p=0;p<pieces;p++)
+    {
+      if(group[p]!=g)
+        continue;
+      int i,j,k;
+      rolled(p,dir,i0,i1,j0,j1,i,j,k);
+      for(int q=0;q<pieces;q++)
+        if(group[q]!=g && piece_i[q]==i && piece_j[q]==j && piece_k[q]==k)
+          return false;
+    }
+    return true;
   }
 
-  void drawCube(float x1,float y1,float z1,int number)
+  void roll(int g,int dir)
   {
+    int i0,i1,j0,j1;
+    bounds(g,i0,i1,j0,j1);
+    for(int p=0;p<pieces;p++)
+      if(group[p]==g)
+        rolled(p,dir,i0,i1,j0,j1,piece_i[p],piece_j[p],piece_k[p]);
+  }
 
-      glm::mat4 translateNet = glm::translate(glm::vec3(x1,y1,z1));
-
-      Matrices.model = glm::mat4(1.0f);
-      glm::mat4 translateRectangle = glm::translate (glm::vec3(0, 0, 13));        // glTranslatef
-      glm::mat4 rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-      if(flag_animate==1 && flag_attach==1)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-      else if(flag_animate==1 && flag_attach==0 && flag_blockOpt==number)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-	  else      	
-      	Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(cube);
-
-      Matrices.model = glm::mat4(1.0f);
-      translateRectangle = glm::translate (glm::vec3(0, 0, 3));        // glTranslatef
-      rotateRectangle = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-      if(flag_animate==1 && flag_attach==1)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-      else if(flag_animate==1 && flag_attach==0 && flag_blockOpt==number)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-	  else      	
-      	Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(cube);
-
-      Matrices.model = glm::mat4(1.0f);
-      translateRectangle = glm::translate (glm::vec3(0, -5, 8));        // glTranslatef
-      rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-      if(flag_animate==1 && flag_attach==1)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-      else if(flag_animate==1 && flag_attach==0 && flag_blockOpt==number)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-	  else      	
-      	Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(cube);
-
-      Matrices.model = glm::mat4(1.0f);
-      translateRectangle = glm::translate (glm::vec3(0, 5, 8));        // glTranslatef
-      rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-      if(flag_animate==1 && flag_attach==1)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-      else if(flag_animate==1 && flag_attach==0 && flag_blockOpt==number)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-	  else      	
-      	Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(cube);
-
-      Matrices.model = glm::mat4(1.0f);
-      translateRectangle = glm::translate (glm::vec3(-5, 0, 8));        // glTranslatef
-      rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-      if(flag_animate==1 && flag_attach==1)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-      else if(flag_animate==1 && flag_attach==0 && flag_blockOpt==number)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-	  else      	
-      	Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(cube);
-
-      Matrices.model = glm::mat4(1.0f);
-      translateRectangle = glm::translate (glm::vec3(5, 0, 8));        // glTranslatef
-      rotateRectangle = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-      if(flag_animate==1 && flag_attach==1)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-      else if(flag_animate==1 && flag_attach==0 && flag_blockOpt==number)
-      	Matrices.model *= (animate * translateNet * translateRectangle * rotateRectangle);
-	  else      	
-      	Matrices.model *= (translateNet * translateRectangle * rotateRectangle);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(cube);
+  /* Join every group the pieces of g now touch into g. Groups apart from
+     the one that moved never touch, so only its pieces need looking at */
+  void merge(int g)
+  {
+    int moved[BLOCK_PIECES],n=0;
+    for(int p=0;p<pieces;p++)
+      if(group[p]==g)
+        moved[n++]=p;
+    for(int m=0;m<n;m++)
+      for(int q=0;q<pieces;q++)
+      {
+        int p=moved[m];
+        if(group[q]==group[p] ||
+           abs(piece_i[p]-piece_i[q])+abs(piece_j[p]-piece_j[q])+abs(piece_k[p]-piece_k[q])/10!=1)
+          continue;
+        int from=max(group[p],group[q]), to=min(group[p],group[q]);
+        for(int r=0;r<pieces;r++)
+          if(group[r]==from)
+            group[r]=to;
+      }
+    flag_attach=1;
+    for(int p=0;p<pieces;p++)
+      if(group[p]!=0)
+        flag_attach=0;
+  }
 
+  /* SPACE: the next group, by its lowest piece */
+  void selectNext()
+  {
+    int g=group[flag_blockOpt];
+    for(int n=1;n<=pieces;n++)
+    {
+      int p=(g+n)%pieces;
+      if(group[p]==p)
+      {
+        flag_blockOpt=p;
+        break;
+      }
+    }
+    flag_stand=column(group[flag_blockOpt]);
+  }
+
+  /* Cell in front of the selected group in +x, j halfway across it - what the block cameras look from */
+  void front(int &i,float &j)
+  {
+    int g=group[flag_blockOpt],i0,i1,j0,j1;
+    bounds(g,i0,i1,j0,j1);
+    i=i1;
+    j0=INT_MAX; j1=INT_MIN;
+    for(int p=0;p<pieces;p++)
+      if(group[p]==g && piece_i[p]==i)
+      {
+        j0=min(j0,piece_j[p]);
+        j1=max(j1,piece_j[p]);
+      }
+    j=(j0+j1)/2.0;
   }
 
   void initiateVariables(int level)
   {
-          cube1i=stage.start[level-1][0];
-          cube1j=stage.start[level-1][1];
-          cube2i=stage.start[level-1][0];
-          cube2j=stage.start[level-1][1];
-          cube1k=0;
-          cube2k=10;
+          pieces=stage.cubes[level-1];
+          for(int p=0;p<pieces;p++)
+          {
+            piece_i[p]=stage.start[level-1][0];
+            piece_j[p]=stage.start[level-1][1];
+            piece_k[p]=p*10;
+            group[p]=0;
+          }
           flag_attach=1;
           flag_blockOpt=0;
           flag_stand=1;
-          fall_lvl3=0;
+          tile_entities.clear();
   }
 
   void animateCube()
   {
-	glm::mat4 translate1,rotate,translate2;  	
-  	if(flag_animate==1 && flag_attach==1)
-  	{ 
-  		if(type==1)
-  		{
-  			if(cube1i>=cube2i)
-  			{
-            translate1 = glm::translate (glm::vec3((cube2i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-((cube2i-8)*10), 5,-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3((cube1i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-((cube1i-8)*10), 5,-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2<=-90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2-=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-  			}
-
-  		}
-  		else if(type==2)
-  		{
-  			if(cube1i>=cube2i)
-  			{
-            translate1 = glm::translate (glm::vec3(10+(cube1i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-(10+(cube1i-8)*10), 5,-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3(10+(cube2i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-(10+(cube2i-8)*10), 5,-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2>=90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2+=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-  			}
-  		}
-  		else if(type==3)
-  		{
-  			if(cube1j>=cube2j)
-  			{
-            translate1 = glm::translate (glm::vec3(-5,10+(cube1j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-(10+(cube1j-5)*10),-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3(-5,10+(cube2j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-(10+(cube2j-5)*10),-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2<=-90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2-=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-  			}
-  		}
-  		else if(type==4)
-  		{
-  			if(cube1j>=cube2j)
-  			{
-            translate1 = glm::translate (glm::vec3(-5,(cube2j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-((cube2j-5)*10),-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3(-5,(cube1j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-((cube1j-5)*10),-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2>=90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2+=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-  			}
-  		}
-  		if(flag_animate==1)
-  			return;
-  	}
-  	else if(flag_animate==1 && flag_attach==0)
+  	if(flag_animate==1)
   	{
-  		if(type==1)
+  		int i0,i1,j0,j1;
+  		bounds(group[flag_blockOpt],i0,i1,j0,j1);
+  		if(type==1 || type==2)
   		{
-  			if(flag_blockOpt==1)
-  			{
-            translate1 = glm::translate (glm::vec3((cube2i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-((cube2i-8)*10), 5,-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3((cube1i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-((cube1i-8)*10), 5,-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2<=-90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2-=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,1);
-  			}
-
-
+            pivot = glm::vec3(type==2 ? 10+(i1-8)*10 : (i0-8)*10, -5,3);
+            axis = glm::vec3(0,1,0);
   		}
-  		else if(type==2)
+  		else
   		{
-  			if(flag_blockOpt==0)
-  			{
-            translate1 = glm::translate (glm::vec3(10+(cube1i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-(10+(cube1i-8)*10), 5,-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3(10+(cube2i-8)*10, -5,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(-(10+(cube2i-8)*10), 5,-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2>=90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2+=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,1);
-  			}
-
+            pivot = glm::vec3(-5,type==3 ? 10+(j1-5)*10 : (j0-5)*10,3);
+            axis = glm::vec3(1,0,0);
   		}
-  		else if(type==3)
-  		{
-  			if(flag_blockOpt==0)
-  			{
-            translate1 = glm::translate (glm::vec3(-5,10+(cube1j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-(10+(cube1j-5)*10),-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3(-5,10+(cube2j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-(10+(cube2j-5)*10),-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2<=-90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2-=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,1);
-  			}
+        angle = zs2;
 
+  		if(type==1 || type==3 ? zs2<=-90 : zs2>=90)
+  		{
+  		flag_animate=0;
+  		fall_call=1;
+  		type=0;
+  		zs2=0;
   		}
-  		else if(type==4)
+  		else
   		{
-  			if(flag_blockOpt==1)
-  			{
-            translate1 = glm::translate (glm::vec3(-5,(cube2j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-((cube2j-5)*10),-3));        // glTranslatef
-            }
-            else
-            {
-            translate1 = glm::translate (glm::vec3(-5,(cube1j-5)*10,3));        // glTranslatef
-            translate2 = glm::translate (glm::vec3(5,-((cube1j-5)*10),-3));        // glTranslatef
-            }
-            rotate = glm::rotate((float)(zs2*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
-            animate=translate1*rotate*translate2;
-
-  			if(zs2>=90)
-  			{
-  			flag_animate=0;
-  			fall_call=1;
-  			type=0;
-  			zs2=0;  				
-  			}
-  			else
-  			{
-  			zs2+=5;
-		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-    	 	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,1);
-  			}
-
+  		zs2+= type==1 || type==3 ? -5 : 5;
+  		drawPieces(LIFT_ALL);
   		}
   		if(flag_animate==1)
   			return;
@@ -1243,24 +1864,7 @@ public:
 
   	if(fall_call==0 && stage.start_stage==0 && stage.end_stage==0)
   	{
-  		if(flag_attach==1)
-  		{
-	    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-     	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-     	}
-     	else
-     	{
-     		if(flag_blockOpt==0)
-     		{
-			    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-     			drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k,0);
-     		}
-     		else
-     		{
-    		    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k,0);
-		     	drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-     		}
-     	}
+  		drawPieces(LIFT_FALLING);
      	return;
   	}
   	else
@@ -1284,8 +1888,7 @@ public:
     			}
     			else
     			{
-			        drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-        			drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
+			        drawPieces(LIFT_ALL);
         			zs1-=5;
         			return;
     			}
@@ -1293,459 +1896,900 @@ public:
   		}
     	if(flag_fall==1)
     	{
-    		if(flag_stand==1)
-    		{
-    			if(zs1<-55)
+    		// a lying pair with one end over the edge first stands up on that end
+    		int g=group[flag_blockOpt],a=-1,b=-1,n=0;
+    		for(int p=0;p<pieces;p++)
+    			if(group[p]==g)
     			{
-    				initiateVariables(stage.level);
-    				flag_fall=0;
-    				if(miss>=miss_limit)
-    				{
-    					flag_gameover=1;
-    				}
-    				zs1=0;
-			      	stage.end_stage=1;
-    				return;
-    			}
-    			else
-    			{
-			        drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-        			drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-        			zs1-=5;
-        			return;
+    				if(n==0)
+    					a=p;
+    				else
+    					b=p;
+    				n++;
     			}
+    		if(flag_stand==0 && n==2 && !(unsupported(a) && unsupported(b)))
+    		{
+    			int from = unsupported(a) ? b : a, to = from==a ? b : a;
+    			piece_i[from]=piece_i[to];piece_j[from]=piece_j[to];
+    			piece_k[from]=10;
+    			zs1=-10;
+			    drawPieces(LIFT_FALLING);
+        		flag_stand=1;
+        		return;
     		}
-    		else if(flag_attach==1)
+    		if(zs1<-55)
     		{
-    			if((stage.stage[stage.level-1][cube1i][cube1j]==0 && stage.stage[stage.level-1][cube2i][cube2j]==0) )
-    			{
-    				if(zs1<-55)
-    				{
-    					zs1=0;
-    					if(miss>=miss_limit)
-    					{
-    						flag_gameover=1;
-    					}
-    					initiateVariables(stage.level);
-    					flag_fall=0;
-			    	  	stage.end_stage=1;
-    					return;
-    				}
-    				else
-    				{
-			    	    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-        				drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-        				zs1-=5;
-        				return;
-    				}
-    			}
-    			else if(stage.stage[stage.level-1][cube1i][cube1j]==0 || cube1i<0 || cube1i>14 || cube1j<0 || cube1j>9)
+    			zs1=0;
+    			if(miss>=miss_limit)
     			{
-    				cube2i=cube1i;cube2j=cube1j;
-    				cube2k=10;
-    				zs1=-10;
-			    	drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-        			drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-        			flag_stand=1;
-        			return;
-    			}
-    			else
-    			{
-    				cube1i=cube2i;cube1j=cube2j;
-    				cube1k=10;
-    				zs1=-10;
-			    	drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-        			drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-        			flag_stand=1;
-        			return;
+    				flag_gameover=1;
     			}
+    			initiateVariables(stage.level);
+    			flag_fall=0;
+			    stage.end_stage=1;
+    			return;
     		}
-    		else{
-    			if(flag_blockOpt==0)
-    			{
-    				if(zs1<-55)
-    				{
-    					zs1=0;
-    					if(miss>=miss_limit)
-    					{
-    						flag_gameover=1;
-    					}
-    					initiateVariables(stage.level);
-    					flag_fall=0;
-    					flag_attach=1;
-			    	  	stage.end_stage=1;
-    					return;
-    				}
-    				else
-    				{
-			    	    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k+zs1,0);
-        				drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k,0);
-        				zs1-=5;
-        				return;
-    				}
-
-    			}
-    			else
-    			{
-    				if(zs1<-55)
-    				{
-    					zs1=0;
-    					if(miss>=miss_limit)
-    					{
-    						flag_gameover=1;
-    					}
-    					initiateVariables(stage.level);
-    					flag_fall=0;
-    					flag_attach=1;
-			    	  	stage.end_stage=1;
-    					return;
-    				}
-    				else
-    				{
-			    	    drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k,0);
-        				drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k+zs1,0);
-        				zs1-=5;
-        				return;
-    				}
-
-    			}
+    		else
+    		{
+			    drawPieces(LIFT_FALLING);
+    			zs1-=5;
+    			return;
     		}
     	}
 
 
     if(stage.start_stage==0 && stage.end_stage==0)
     {
-      if(flag_attach==1)
+    	if(flag_shift==1)
+    	{
+    		for(int p=0;p<pieces;p++)
+    		{
+    			piece_i[p]=stage.split[stage.level-1][p][0];
+    			piece_j[p]=stage.split[stage.level-1][p][1];
+    			piece_k[p]=0;
+    			group[p]=p;
+    		}
+    		flag_shift=0;
+    	}
+
+    	int g=group[flag_blockOpt];
+    	if(move_flag>=1 && move_flag<=4)
+    	{
+    		roll(g,move_flag);
+    		move_flag=0;
+    	}
+    	merge(g);
+    	g=group[flag_blockOpt];
+    	flag_stand=column(g);
+    }
+
+      // a column breaks fragile tiles and drops into holes, where only the whole block
+      // standing on the target completes the level. Anything else falls with any cube unsupported
+      int g=group[flag_blockOpt];
+      if(flag_stand==1)
       {
-        if(move_flag==1)
+        int p=flag_blockOpt;
+        if(offGrid(p) || stage.stage[stage.level-1][piece_i[p]][piece_j[p]]==2 || stage.stage[stage.level-1][piece_i[p]][piece_j[p]]==0)
         {
-          if(flag_stand==1)
+          if(flag_attach==1 && stage.target[stage.level-1][0]==piece_i[p] && stage.target[stage.level-1][1]==piece_j[p])
           {
-            if(cube1k<cube2k)
-            {
-              cube1i-=1;
-              cube2i-=2;
-              cube2k=0;
-              flag_stand=0;
-            }
-            else
-            {
-              cube1i-=2;
-              cube2i-=1;
-              cube1k=0;
-              flag_stand=0;
-            }
+            flag_complete=1;
+            flag_fallcomp=1;
+            zs1=0;
           }
           else
           {
-            if(cube1i<cube2i)
-            {
-              cube1i-=1;
-              cube2i-=2;
-              flag_stand=1;
-              cube2k=10;
-            }
-            else if(cube1i>cube2i)
-            {
-              cube1i-=2;
-              cube2i-=1;
-              flag_stand=1;
-              cube1k=10;
-            }
-            else
-            {
-              cube1i-=1;
-              cube2i-=1;
-            }
+            flag_fall=1;
+            miss++;
+            zs1=0;
           }
-          move_flag=0;
         }
-        else if(move_flag==2)
+      }
+      else
+      {
+        bool hole=false;
+        for(int p=0;p<pieces;p++)
+          hole = hole || (group[p]==g && unsupported(p));
+        if(hole)
         {
-          if(flag_stand==1)
-          {
-            if(cube1k<cube2k)
-            {
-              cube1i+=1;
-              cube2i+=2;
-              cube2k=0;
-              flag_stand=0;
-            }
-            else
-            {
-              cube1i+=2;
-              cube2i+=1;
-              cube1k=0;
-              flag_stand=0;
-            }
-          }
-          else
+          flag_fall=1;
+          miss++;
+          zs1=0;
+        }
+      }
+
+      bool off=false;
+      for(int q=0;q<pieces;q++)
+        off = off || offGrid(q);
+      if(off)
+      {
+      	if(flag_fall!=1)
+      	{
+		drawPieces(LIFT_NONE);
+      	flag_fall=1;
+      	miss++;
+      	zs1=0;
+      	}
+      }
+      if(stage.start_stage==0 && stage.end_stage==0)
+      {
+        drawPieces(LIFT_NONE);
+      }
+      if(flag_check==1)
+      {
+        int ci[BLOCK_PIECES],cj[BLOCK_PIECES],n=0;
+        for(int p=0;p<pieces;p++)
+          if(group[p]==g)
           {
-            if(cube1i<cube2i)
-            {
-              cube1i+=2;
-              cube2i+=1;
-              flag_stand=1;
-              cube1k=10;
-            }
-            else if(cube1i>cube2i)
-            {
-              cube1i+=1;
-              cube2i+=2;
-              flag_stand=1;
-              cube2k=10;
-            }
-            else
-            {
-              cube1i+=1;
-              cube2i+=1;
-            }
+            ci[n]=piece_i[p];
+            cj[n++]=piece_j[p];
           }
-          move_flag=0;
+	 	stage.checkTouch(ci,cj,n);
+	 	flag_check=0;
+	  }
+  }
+
+}block;
+
+
+/* Tile height after the stage wave - must match waveHeight() in Tile_GL.vert */
+float waveHeight(const TileDraw &t, int mode, float zs)
+{
+  if(t.wave==0)
+    return t.z;
+  if(mode==WAVE_RISE)
+    return min(zs+2*t.i+3*t.j, 0.0f);
+  if(mode==WAVE_SINK)
+  {
+    float z = zs-2*(14-t.i)-3*(9-t.j);
+    return z<-90 ? -100 : z;
+  }
+  return zs;
+}
+
+/* Tiles are drawn instanced, one call per face and kind of tile. Positions
+   and wave heights come from the TileDraw instance data, so a level
+   transition only changes the wave uniform */
+struct TileShader {
+  GLuint program, VP, faces, wave;
+} tile_shader;
+
+/* The wall mesh wall face f is drawn with */
+VAO *wallMesh(bool fragile, int f)
+{
+  if(tile_faces[f][5])
+    return fragile ? stage.rect5m : stage.rect2m;
+  return fragile ? stage.rect5 : stage.rect2;
+}
+
+/* Per-instance data of the fast path: the tile and which face of it */
+struct FaceInstance {
+  TileDraw tile;
+  float face;
+};
+
+struct TileBatch {
+  GLuint vbo;
+  vector<TileDraw> source;      // as recorded, to spot changes
+  vector<TileDraw> sorted;      // what is in vbo, the fast path copies faces out of it
+  int first[TILE_KINDS+1];      // instances sorted by kind
+  int loose_first[2][2];        // then per body colour the tiles off the stage wave (wave 0),
+                                // the rest are in slab_mesh while the stage is at rest
+
+  // the same ranges over just the tiles in view, rebuilt every perspective pass
+  long cull_at;                 // offset in the stream buffer
+  vector<TileDraw> cull_sorted;
+  int cull_first[TILE_KINDS+1];
+  int cull_loose[2][2];
+
+  // round switches and teleports again, sorted by kind then disc detail, every scene pass
+  long disc_at;
+  vector<TileDraw> disc_sorted;
+  int disc_first[2*CIRCLE_LODS+1];
+
+  // fast path: every face of the pass gathered into one multi-draw
+  IndirectBatch indirect;
+  vector<FaceInstance> instances;
+  TileBatch() : vbo(0), cull_at(0), disc_at(0) {}
+} tile_batch;
+
+/* At rest the stage tiles sit level with each other, so their tops, bottoms and
+   outer walls are greedily merged into as few quads as possible. Slab_GL.frag
+   repeats the per-tile shading across each quad */
+struct SlabVertex {
+  GLfloat x, y, z;
+  GLfloat s, t, wall;     // pattern coordinates, see Slab_GL.vert
+  GLfloat edge[3], centre[3];
+};
+
+struct SlabShader {
+  GLuint program, VP, height;
+} slab_shader;
+
+struct SlabMesh {
+  GLuint vao, vbo;
+  int first[4];           // tops, bottoms, walls, end
+  vector<int> cells;      // i, j, body of the merged tiles, to spot changes
+  vector<glm::vec3> lo, hi;   // bounds of each quad (6 vertices) at height 0, for culling
+  SlabMesh() : vao(0), vbo(0) { first[0]=first[1]=first[2]=first[3]=0; }
+} slab_mesh;
+
+
+/* Two triangles over corners c[0..3], counter-clockwise seen from the front.
+   ox,oy is the centre of cell 0,0, pattern s runs along dir (0 +x, 1 -x, 2 +y, 3 -y) */
+void addSlabQuad(vector<SlabVertex> &out, const glm::vec3 *c, int body, bool wall, int dir, float ox, float oy)
+{
+  static const int order[6] = { 0, 1, 2, 2, 3, 0 };
+  for(int k=0;k<6;k++)
+  {
+    const glm::vec3 &p = c[order[k]];
+    SlabVertex v;
+    v.x = p.x; v.y = p.y; v.z = p.z;
+    float along[4] = { p.x-ox, ox-p.x, p.y-oy, oy-p.y };
+    v.s = along[dir];
+    v.t = wall ? p.z-2 : p.y-oy;
+    v.wall = wall ? 1 : 0;
+    for(int a=0;a<3;a++)
+    {
+      v.edge[a] = tile_edge[body][a];
+      v.centre[a] = tile_centre[body][a];
+    }
+    out.push_back(v);
+  }
+}
+
+/* Merge the level tiles (wave != 0) of one body colour into rectangles, then the exposed walls into strips */
+void buildSlabMesh(const vector<TileDraw> &tiles)
+{
+  vector<int> cells;
+  int ni=0, nj=0;
+  float ox=0, oy=0;
+  for(size_t i=0;i<tiles.size();i++)
+    if(tiles[i].wave!=0)
+    {
+      const TileDraw &t = tiles[i];
+      cells.push_back(t.i);
+      cells.push_back(t.j);
+      cells.push_back(tileKind(t.type)==TILES_FRAGILE);
+      ni = max(ni, (int)t.i+1);
+      nj = max(nj, (int)t.j+1);
+      ox = t.x-t.i*10;
+      oy = t.y-t.j*10;
+    }
+  if(cells==slab_mesh.cells && slab_mesh.vbo!=0)
+    return;
+  slab_mesh.cells = cells;
+
+  // body colour per cell, -1 for none
+  vector<int> grid(ni*nj, -1);
+  for(size_t c=0;c<cells.size();c+=3)
+    grid[cells[c]*nj+cells[c+1]] = cells[c+2];
+  #define SLAB_CELL(i,j) ((i)>=0 && (i)<ni && (j)>=0 && (j)<nj ? grid[(i)*nj+(j)] : -1)
+
+  vector<SlabVertex> tops, bottoms, walls;
+  vector<char> used(ni*nj, 0);
+  int quads=0;
+  for(int j=0;j<nj;j++)
+    for(int i=0;i<ni;i++)
+    {
+      int body = SLAB_CELL(i,j);
+      if(body<0 || used[i*nj+j])
+        continue;
+      // widest run along i, then as many rows of it along j as match
+      int w=1, h=1;
+      while(SLAB_CELL(i+w,j)==body && !used[(i+w)*nj+j])
+        w++;
+      for(bool grow=true; grow; )
+      {
+        for(int k=0;k<w && grow;k++)
+          grow = SLAB_CELL(i+k,j+h)==body && !used[(i+k)*nj+j+h];
+        if(grow)
+          h++;
+      }
+      for(int k=0;k<w;k++)
+        for(int l=0;l<h;l++)
+          used[(i+k)*nj+j+l] = 1;
+
+      float x0=ox+i*10-5, x1=ox+(i+w)*10-5, y0=oy+j*10-5, y1=oy+(j+h)*10-5;
+      glm::vec3 top[4] = { glm::vec3(x0,y0,3), glm::vec3(x1,y0,3), glm::vec3(x1,y1,3), glm::vec3(x0,y1,3) };
+      glm::vec3 bottom[4] = { glm::vec3(x0,y0,1), glm::vec3(x0,y1,1), glm::vec3(x1,y1,1), glm::vec3(x1,y0,1) };
+      addSlabQuad(tops, top, body, false, 0, ox, oy);
+      addSlabQuad(bottoms, bottom, body, false, 0, ox, oy);
+      quads++;
+    }
+
+  // Walls with no level tile behind them, in runs along the side they face:
+  // -y, +y, -x, +x with the pattern direction of each wall mesh
+  static const int sides[4][3] = { { 0, -1, 0 }, { 0, 1, 0 }, { -1, 0, 2 }, { 1, 0, 2 } };
+  int exposed=0;
+  for(int d=0;d<4;d++)
+  {
+    bool rows = sides[d][0]==0;           // walls facing y run along i
+    int lines = rows ? nj : ni, length = rows ? ni : nj;
+    for(int a=0;a<lines;a++)
+      for(int b=0;b<length;)
+      {
+        int i = rows ? b : a, j = rows ? a : b;
+        int body = SLAB_CELL(i,j);
+        if(body<0 || SLAB_CELL(i+sides[d][0], j+sides[d][1])>=0)
+        {
+          b++;
+          continue;
         }
-        else if(move_flag==3)
+        int n=1;
+        for(;;n++)
         {
-          if(flag_stand==1)
-          {
-            if(cube1k<cube2k)
-            {
-              cube1j+=1;
-              cube2j+=2;
-              cube2k=0;
-              flag_stand=0;
-            }
-            else
-            {
-              cube1j+=2;
-              cube2j+=1;
-              cube1k=0;
-              flag_stand=0;
-            }
-          }
+          int ii = rows ? b+n : a, jj = rows ? a : b+n;
+          if(SLAB_CELL(ii,jj)!=body || SLAB_CELL(ii+sides[d][0], jj+sides[d][1])>=0)
+            break;
+        }
+        exposed+=n;
+
+        glm::vec3 c[4];
+        if(rows)
+        {
+          float y = oy+j*10+5*sides[d][1], x0=ox+i*10-5, x1=ox+(i+n)*10-5;
+          glm::vec3 lo0(x0,y,1), lo1(x1,y,1), hi1(x1,y,3), hi0(x0,y,3);
+          if(sides[d][1]<0)
+          { c[0]=lo0; c[1]=lo1; c[2]=hi1; c[3]=hi0; }
           else
-          {
-            if(cube1j<cube2j)
-            {
-              cube1j+=2;
-              cube2j+=1;
-              flag_stand=1;
-              cube1k=10;
-            }
-            else if(cube1j>cube2j)
-            {
-              cube1j+=1;
-              cube2j+=2;
-              flag_stand=1;
-              cube2k=10;
-            }
-            else
-            {
-              cube1j+=1;
-              cube2j+=1;
-            }
-          }
-          move_flag=0;
+          { c[0]=lo0; c[1]=hi0; c[2]=hi1; c[3]=lo1; }
         }
-        else if(move_flag==4)
+        else
         {
-          if(flag_stand==1)
-          {
-            if(cube1k<cube2k)
-            {
-              cube1j-=1;
-              cube2j-=2;
-              cube2k=0;
-              flag_stand=0;
-            }
-            else
-            {
-              cube1j-=2;
-              cube2j-=1;
-              cube1k=0;
-              flag_stand=0;
-            }
-          }
+          float x = ox+i*10+5*sides[d][0], y0=oy+j*10-5, y1=oy+(j+n)*10-5;
+          glm::vec3 lo0(x,y0,1), lo1(x,y1,1), hi1(x,y1,3), hi0(x,y0,3);
+          if(sides[d][0]>0)
+          { c[0]=lo0; c[1]=lo1; c[2]=hi1; c[3]=hi0; }
           else
-          {
-            if(cube1j<cube2j)
-            {
-              cube1j-=1;
-              cube2j-=2;
-              flag_stand=1;
-              cube2k=10;
-            }
-            else if(cube1j>cube2j)
-            {
-              cube1j-=2;
-              cube2j-=1;
-              flag_stand=1;
-              cube1k=10;
-            }
-            else
-            {
-              cube1j-=1;
-              cube2j-=1;
-            }
-          }
-          move_flag=0;
+          { c[0]=lo0; c[1]=hi0; c[2]=hi1; c[3]=lo1; }
         }
+        addSlabQuad(walls, c, body, true, sides[d][2], ox, oy);
+        b+=n;
       }
-    	else
-    	{
-    		if(flag_shift==1)
-    		{
-				cube1i=10;
-  				cube2i=10;
-  				cube2j=1;
-  				cube1j=7;
-  				cube1k=0;
-  				cube2k=0;
-  				flag_shift=0;
-  			
-    		}
-    		if(flag_blockOpt==0)
-    		{
-    			if(move_flag==1)
-    			{
-    				cube1i--;
-    				move_flag=0;
-    			}
-    			else if(move_flag==2)
-    			{
-    				cube1i++;
-    				move_flag=0;
-    			}
-    			else if(move_flag==3)
-    			{
-    				cube1j++;
-    				move_flag=0;
-    			}
-    			else if(move_flag==4)
-    			{
-    				cube1j--;
-    				move_flag=0;
-    			}
+  }
+  #undef SLAB_CELL
+
+  vector<SlabVertex> all;
+  slab_mesh.first[0] = 0;
+  all.insert(all.end(), tops.begin(), tops.end());
+  slab_mesh.first[1] = all.size();
+  all.insert(all.end(), bottoms.begin(), bottoms.end());
+  slab_mesh.first[2] = all.size();
+  all.insert(all.end(), walls.begin(), walls.end());
+  slab_mesh.first[3] = all.size();
+  slab_mesh.lo.clear();
+  slab_mesh.hi.clear();
+  for(size_t v=0;v<all.size();v+=6)
+  {
+    glm::vec3 lo(all[v].x, all[v].y, all[v].z), hi = lo;
+    for(int k=1;k<6;k++)
+    {
+      glm::vec3 p(all[v+k].x, all[v+k].y, all[v+k].z);
+      lo = glm::min(lo, p);
+      hi = glm::max(hi, p);
+    }
+    slab_mesh.lo.push_back(lo);
+    slab_mesh.hi.push_back(hi);
+  }
 
-    			if(stage.stage[stage.level-1][cube1i][cube1j]==0)
-    			{
-    				flag_fall=1;
-    				miss++;
-    				zs1=0;
-    			}
+  if(slab_mesh.vao==0)
+  {
+    slab_mesh.vao = gpu.vertexArray();
+    slab_mesh.vbo = gpu.buffer();
+    static const GLuint offsets[4] = { offsetof(SlabVertex, x), offsetof(SlabVertex, s),
+                                       offsetof(SlabVertex, edge), offsetof(SlabVertex, centre) };
+    if(fast_path)
+      glVertexArrayVertexBuffer(slab_mesh.vao, 0, slab_mesh.vbo, 0, sizeof(SlabVertex));
+    else
+    {
+      glBindVertexArray(slab_mesh.vao);
+      glBindBuffer(GL_ARRAY_BUFFER, slab_mesh.vbo);
+    }
+    for(int a=0;a<4;a++)
+    {
+      if(fast_path)
+      {
+        glEnableVertexArrayAttrib(slab_mesh.vao, a);
+        glVertexArrayAttribFormat(slab_mesh.vao, a, 3, GL_FLOAT, GL_FALSE, offsets[a]);
+        glVertexArrayAttribBinding(slab_mesh.vao, a, 0);
+        continue;
+      }
+      glEnableVertexAttribArray(a);
+      glVertexAttribPointer(a, 3, GL_FLOAT, GL_FALSE, sizeof(SlabVertex), (void*)(size_t)offsets[a]);
+    }
+  }
+  gpu.bufferData(slab_mesh.vbo, all.size()*sizeof(SlabVertex), all.empty() ? NULL : &all[0], GL_STATIC_DRAW);
 
+  if(render_stats.enabled)
+  {
+    // per tile: a 4 triangle top and bottom, 2 triangles for each wall left after hidden-face removal
+    int tiles_merged = cells.size()/3;
+    long before = 8L*tiles_merged + 2L*exposed, after = all.size()/3;
+    printf("Stage mesh: %d tiles, %ld triangles / %ld vertices merged into %d rectangles, %ld triangles / %ld vertices\n",
+           tiles_merged, before, 3*before, quads, after, (long)all.size());
+  }
+}
 
-    		}
-    		else if(flag_blockOpt==1)
-    		{
-    			if(move_flag==1)
-    			{
-    				cube2i--;
-    				move_flag=0;
-    			}
-    			else if(move_flag==2)
-    			{
-    				cube2i++;
-    				move_flag=0;
-    			}
-    			else if(move_flag==3)
-    			{
-    				cube2j++;
-    				move_flag=0;
-    			}
-    			else if(move_flag==4)
-    			{
-    				cube2j--;
-    				move_flag=0;
-    			}
+/* Order tiles by kind, then again per body colour those off the wave, recording where each range starts */
+void sortTiles(const vector<TileDraw> &tiles, vector<TileDraw> &sorted, int *first, int loose[2][2])
+{
+  sorted.clear();
+  sorted.reserve(tiles.size()*2);
+  for(int k=0;k<TILE_KINDS;k++)
+  {
+    first[k] = sorted.size();
+    for(size_t i=0;i<tiles.size();i++)
+      if(tileKind(tiles[i].type)==k)
+        sorted.push_back(tiles[i]);
+  }
+  first[TILE_KINDS] = sorted.size();
 
-    			if(stage.stage[stage.level-1][cube2i][cube2j]==0)
-    			{
-    				flag_fall=1;
-    				miss++;
-    				zs1=0;
-    			}
-    		}
+  for(int b=0;b<2;b++)
+  {
+    loose[b][0] = sorted.size();
+    for(size_t i=0;i<tiles.size();i++)
+      if(tiles[i].wave==0 && (tileKind(tiles[i].type)==TILES_FRAGILE)==(b==1))
+        sorted.push_back(tiles[i]);
+    loose[b][1] = sorted.size();
+  }
+}
 
-	    	if(abs(cube1i-cube2i)==1 && abs(cube1j-cube2j)==0)
-    		{
-   				flag_attach=1;
-   			}
-   			else if(abs(cube1i-cube2i)==0 && abs(cube1j-cube2j)==1)
-   			{
-  				flag_attach=1;
-   			}
+/* View frustum culling for the perspective cameras. Tiles are bucketed into
+   CULL_REGION x CULL_REGION blocks of the grid when uploaded; a block wholly
+   outside the frustum drops its tiles, one wholly inside keeps them, and only
+   blocks crossing a plane are tested tile by tile */
+#define CULL_REGION 4
 
-    	}
+struct Frustum {
+  glm::vec4 planes[6];      // inside where dot(plane, (p,1)) >= 0
+};
+
+/* Planes of the clip volume pulled back through VP */
+Frustum frustumOf(const glm::mat4 &VP)
+{
+  Frustum f;
+  glm::vec4 row[4];
+  for(int r=0;r<4;r++)
+    row[r] = glm::vec4(VP[0][r], VP[1][r], VP[2][r], VP[3][r]);
+  for(int a=0;a<3;a++)
+  {
+    f.planes[2*a] = row[3]+row[a];
+    f.planes[2*a+1] = row[3]-row[a];
+  }
+  return f;
+}
+
+enum { BOX_OUTSIDE, BOX_CROSSING, BOX_INSIDE };
+
+int boxInFrustum(const Frustum &f, const glm::vec3 &lo, const glm::vec3 &hi)
+{
+  int result = BOX_INSIDE;
+  for(int p=0;p<6;p++)
+  {
+    const glm::vec4 &n = f.planes[p];
+    // the corners furthest along and against the plane normal
+    glm::vec3 far(n.x>=0 ? hi.x : lo.x, n.y>=0 ? hi.y : lo.y, n.z>=0 ? hi.z : lo.z);
+    glm::vec3 near(n.x>=0 ? lo.x : hi.x, n.y>=0 ? lo.y : hi.y, n.z>=0 ? lo.z : hi.z);
+    if(n.x*far.x+n.y*far.y+n.z*far.z+n.w < 0)
+      return BOX_OUTSIDE;
+    if(n.x*near.x+n.y*near.y+n.z*near.z+n.w < 0)
+      result = BOX_CROSSING;
+  }
+  return result;
+}
+
+struct TileRegion {
+  int i0, j0;                 // first cell of the block
+  glm::vec2 lo, hi;           // ground extent of its tiles
+  vector<int> tiles;          // indices into tile_batch.source, tiles on the wave only
+};
 
+struct TileCulling {
+  vector<TileRegion> regions;
+  vector<int> loose;          // tiles off the wave, tested one by one
+  vector<TileDraw> visible;
+} tile_culling;
+
+void bucketTiles(const vector<TileDraw> &tiles)
+{
+  tile_culling.regions.clear();
+  tile_culling.loose.clear();
+  vector<int> index;          // region of each block, -1 until used
+  int blocks_i=0;
+  for(size_t i=0;i<tiles.size();i++)
+    blocks_i = max(blocks_i, (int)tiles[i].i/CULL_REGION+1);
+  for(size_t i=0;i<tiles.size();i++)
+  {
+    const TileDraw &t = tiles[i];
+    if(t.wave==0)
+    {
+      tile_culling.loose.push_back(i);
+      continue;
     }
+    int bi = (int)t.i/CULL_REGION, bj = (int)t.j/CULL_REGION, key = bj*blocks_i+bi;
+    if(key>=(int)index.size())
+      index.resize(key+1, -1);
+    if(index[key]<0)
+    {
+      index[key] = tile_culling.regions.size();
+      TileRegion r;
+      r.i0 = bi*CULL_REGION;
+      r.j0 = bj*CULL_REGION;
+      r.lo = glm::vec2(t.x-5, t.y-5);
+      r.hi = glm::vec2(t.x+5, t.y+5);
+      tile_culling.regions.push_back(r);
+    }
+    TileRegion &r = tile_culling.regions[index[key]];
+    r.lo = glm::min(r.lo, glm::vec2(t.x-5, t.y-5));
+    r.hi = glm::max(r.hi, glm::vec2(t.x+5, t.y+5));
+    r.tiles.push_back(i);
+  }
+}
 
-      if(flag_attach==1)
+/* Tiles of fs that can be in view. Wave heights rise with i and j, so a block's
+   lowest and highest tiles are at its first and last cells */
+void cullTiles(const FrameState &fs, vector<TileDraw> &visible)
+{
+  Frustum f = frustumOf(fs.VP);
+  const vector<TileDraw> &tiles = tile_batch.source;
+  visible.clear();
+  for(size_t r=0;r<tile_culling.regions.size();r++)
+  {
+    const TileRegion &region = tile_culling.regions[r];
+    TileDraw first = { 0, 0, 0, 0, (float)region.i0, (float)region.j0, 1 };
+    TileDraw last = { 0, 0, 0, 0, (float)(region.i0+CULL_REGION-1), (float)(region.j0+CULL_REGION-1), 1 };
+    glm::vec3 lo(region.lo, waveHeight(first, fs.wave_mode, fs.wave_zs)+1);
+    glm::vec3 hi(region.hi, waveHeight(last, fs.wave_mode, fs.wave_zs)+3.2f);
+    int in = boxInFrustum(f, lo, hi);
+    if(in==BOX_OUTSIDE)
+    {
+      render_stats.tiles_culled += region.tiles.size();
+      continue;
+    }
+    for(size_t k=0;k<region.tiles.size();k++)
+    {
+      const TileDraw &t = tiles[region.tiles[k]];
+      if(in==BOX_CROSSING)
       {
-        if(flag_stand==1)
+        float z = waveHeight(t, fs.wave_mode, fs.wave_zs);
+        if(boxInFrustum(f, glm::vec3(t.x-5, t.y-5, z+1), glm::vec3(t.x+5, t.y+5, z+3.2f))==BOX_OUTSIDE)
         {
-          if(stage.stage[stage.level-1][cube1i][cube1j]==2 || stage.stage[stage.level-1][cube1i][cube1j]==0)
-          {
-            if(stage.target[stage.level-1][0]==cube1i && stage.target[stage.level-1][1]==cube1j)
-            {
-              flag_complete=1;
-              flag_fallcomp=1;
-              zs1=0;
-            }
-            else
-            {
-              flag_fall=1;
-              miss++;
-              zs1=0;
-            }
-          }
+          render_stats.tiles_culled++;
+          continue;
         }
-        else
-        {
-          if(stage.stage[stage.level-1][cube1i][cube1j]==0 || stage.stage[stage.level-1][cube2i][cube2j]== 0)
-          {
-          	if(stage.stage[stage.level-1][cube1i][cube1j]==0 && stage.stage[stage.level-1][cube2i][cube2j]== 0)
-            {
-            flag_fall=1;
-            miss++;
-            zs1=0;
-            }
-            else
-            {
-		        drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k,0);
-        		drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k,0);
-		            flag_fall=1;
-		            miss++;
-        		    zs1=0;
+      }
+      visible.push_back(t);
+    }
+  }
+  for(size_t k=0;k<tile_culling.loose.size();k++)
+  {
+    const TileDraw &t = tiles[tile_culling.loose[k]];
+    if(boxInFrustum(f, glm::vec3(t.x-5, t.y-5, t.z+1), glm::vec3(t.x+5, t.y+5, t.z+3.2f))==BOX_OUTSIDE)
+      render_stats.tiles_culled++;
+    else
+      visible.push_back(t);
+  }
+  render_stats.tiles_drawn += visible.size();
+}
 
-            }
-          }
-        }
-      } 
+void uploadTiles(const vector<TileDraw> &tiles)
+{
+  if(tile_batch.vbo==0)
+    tile_batch.vbo = gpu.buffer();
 
-      if(cube1i<0 || cube2i<0 || cube1j<0 || cube2j<0 || cube1i>14 || cube2i>14 || cube1j>9 || cube2j>9)
-      {
-      	if(flag_fall!=1)
-      	{
-		drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k,0);
-        drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k,0);
-      	flag_fall=1;
-      	miss++;
-      	zs1=0;
-      	}
-      }
-      if(stage.start_stage==0 && stage.end_stage==0)
+  vector<TileDraw> &sorted = tile_batch.sorted;
+  sortTiles(tiles, sorted, tile_batch.first, tile_batch.loose_first);
+
+  if(!fast_path)    // the fast path copies instances out of sorted instead
+    gpu.bufferData(tile_batch.vbo, sorted.size()*sizeof(TileDraw), sorted.empty() ? NULL : &sorted[0], GL_STATIC_DRAW);
+  tile_batch.source = tiles;
+  bucketTiles(tiles);
+
+  // only redone when the level tiles themselves change: a level load or a bridge switch
+  buildSlabMesh(tiles);
+}
+
+/* Sort and upload the tiles in view into the culled ranges */
+void uploadVisibleTiles(const vector<TileDraw> &visible)
+{
+  vector<TileDraw> &sorted = tile_batch.cull_sorted;
+  sortTiles(visible, sorted, tile_batch.cull_first, tile_batch.cull_loose);
+
+  if(!fast_path)    // the fast path copies instances out of sorted instead
+    tile_batch.cull_at = stream.write(sorted.empty() ? NULL : &sorted[0], sorted.size()*sizeof(TileDraw));
+}
+
+/* Whether the camera can see tile bottoms at all: a perspective eye under the lowest
+   resting bottom (z=1), or an orthographic one looking upwards */
+bool bottomsVisible(const glm::mat4 &VP)
+{
+  // the eye for perspective, the direction of increasing depth for ortho
+  glm::vec4 h = glm::inverse(VP) * glm::vec4(0, 0, 1, 0);
+  if(fabs(h.w)>1e-6)
+    return h.z/h.w < 1;
+  return h.z > 0;
+}
+
+/* Fewest half-disc segments that keep the chord error under half a pixel for this tile's disc */
+int discLod(const TileDraw &t, const FrameState &fs)
+{
+  float z = waveHeight(t, fs.wave_mode, fs.wave_zs)+3.2f;
+  glm::vec4 c = fs.VP * glm::vec4(t.x, t.y, z, 1);
+  if(c.w<=0)
+    return 0;
+
+  // on-screen radius, the larger of the two ground axes under perspective
+  float r = 0;
+  for(int a=0;a<2;a++)
+  {
+    glm::vec4 e = fs.VP * glm::vec4(t.x+(a==0 ? 4.5f : 0), t.y+(a==1 ? 4.5f : 0), z, 1);
+    if(e.w<=0)
+      return CIRCLE_LODS-1;
+    float dx = (e.x/e.w-c.x/c.w)*0.5f*fb_width, dy = (e.y/e.w-c.y/c.w)*0.5f*fb_height;
+    r = max(r, (float)sqrt(dx*dx+dy*dy));
+  }
+
+  // N segments over half a turn miss the arc by r*(1-cos(pi/2N)) ~ r*pi*pi/(8*N*N)
+  float needed = M_PI*sqrt(r)/2;
+  for(int l=0;l<CIRCLE_LODS;l++)
+    if(circle_segments[l]>=needed)
+      return l;
+  return CIRCLE_LODS-1;
+}
+
+/* Sort this frame's round switches and teleports by disc detail into the stream buffer */
+void uploadDiscs(const FrameState &fs, const vector<TileDraw> &tiles)
+{
+  vector<TileDraw> discs, &sorted = tile_batch.disc_sorted;
+  vector<int> lods;
+  sorted.clear();             // key: teleports after round switches, then detail
+  for(size_t i=0;i<tiles.size();i++)
+  {
+    int kind = tileKind(tiles[i].type);
+    if(kind==TILES_ROUND || kind==TILES_TELEPORT)
+    {
+      discs.push_back(tiles[i]);
+      lods.push_back((kind==TILES_TELEPORT)*CIRCLE_LODS + discLod(tiles[i], fs));
+    }
+  }
+  for(int key=0;key<2*CIRCLE_LODS;key++)
+  {
+    tile_batch.disc_first[key] = sorted.size();
+    for(size_t i=0;i<discs.size();i++)
+      if(lods[i]==key)
+        sorted.push_back(discs[i]);
+  }
+  tile_batch.disc_first[2*CIRCLE_LODS] = sorted.size();
+
+  if(!fast_path)    // the fast path copies instances out of sorted instead
+    tile_batch.disc_at = stream.write(sorted.empty() ? NULL : &sorted[0], sorted.size()*sizeof(TileDraw));
+}
+
+/* Sorted tile instances, on the CPU and from byte offset at of a GL buffer */
+struct TileSource {
+  const vector<TileDraw> *tiles;
+  GLuint vbo;
+  long at;
+};
+
+/* Draw mesh as tile face f once per tile in instances [first,last) of src. On the fast
+   path this only queues the draw for submitTileFaces */
+void drawTileFace(VAO *mesh, const TileSource &src, int first, int last, int f)
+{
+  if(last<=first)
+    return;
+  render_stats.tile_triangles += (long)(last-first)*mesh->NumVertices/3;
+  if(fast_path)
+  {
+    tile_batch.indirect.add(mesh, tile_batch.instances.size(), last-first);
+    for(int t=first;t<last;t++)
+    {
+      FaceInstance in = { (*src.tiles)[t], (float)f };
+      tile_batch.instances.push_back(in);
+    }
+    return;
+  }
+  glPolygonMode (GL_FRONT_AND_BACK, mesh->FillMode);
+  glBindVertexArray (mesh->VertexArrayID);
+  // attribute array state belongs to the vertex array, so only once it is bound:
+  // renderCubes leaves 4 enabled on it for the cube pivots
+  glDisableVertexAttribArray(4);
+  glVertexAttrib1f(4, f);
+  glBindBuffer(GL_ARRAY_BUFFER, src.vbo);
+  size_t base = src.at + first*sizeof(TileDraw);
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(TileDraw), (void*)(base+offsetof(TileDraw, x)));
+  glVertexAttribDivisor(2, 1);
+  glEnableVertexAttribArray(3);
+  glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(TileDraw), (void*)(base+offsetof(TileDraw, i)));
+  glVertexAttribDivisor(3, 1);
+  glDrawArraysInstanced(mesh->PrimitiveMode, mesh->First, mesh->NumVertices, last-first);
+  render_stats.drew(1);
+}
+
+/* Fast path: draw every face queued this pass in one call */
+void submitTileFaces()
+{
+  TileBatch &b = tile_batch;
+  if(b.indirect.vao==0)
+  {
+    static const GLuint attribs[3][3] = {
+      { 2, 3, offsetof(FaceInstance, tile)+offsetof(TileDraw, x) },
+      { 3, 3, offsetof(FaceInstance, tile)+offsetof(TileDraw, i) },
+      { 4, 1, offsetof(FaceInstance, face) },
+    };
+    b.indirect.create(attribs, 3);
+  }
+  render_stats.drew(b.indirect.submit(b.instances.empty() ? NULL : &b.instances[0],
+                                      b.instances.size()*sizeof(FaceInstance), sizeof(FaceInstance)));
+  b.instances.clear();
+}
+
+/* Draw all recorded tiles - render thread only, leaves programID in use */
+void renderTiles(const FrameState &fs)
+{
+  if(fs.tiles.size()!=tile_batch.source.size() ||
+     (!fs.tiles.empty() && memcmp(&fs.tiles[0], &tile_batch.source[0], fs.tiles.size()*sizeof(TileDraw))))
+    uploadTiles(fs.tiles);
+
+  glUseProgram(tile_shader.program);
+  glUniformMatrix4fv(tile_shader.VP, 1, GL_FALSE, &fs.VP[0][0]);
+  glUniform2f(tile_shader.wave, (float)fs.wave_mode, fs.wave_zs);
+
+  // the perspective cameras see part of the grid, draw only the tiles in view
+  TileSource src = { &tile_batch.sorted, tile_batch.vbo, 0 };
+  const int *first = tile_batch.first, *all = tile_batch.first;
+  int (*loose)[2] = tile_batch.loose_first;
+  const vector<TileDraw> *tiles = &fs.tiles;
+  if(!fs.ortho)
+  {
+    cullTiles(fs, tile_culling.visible);
+    uploadVisibleTiles(tile_culling.visible);
+    TileSource culled = { &tile_batch.cull_sorted, stream.buffer, tile_batch.cull_at };
+    src = culled;
+    first = tile_batch.cull_first;
+    loose = tile_batch.cull_loose;
+    tiles = &tile_culling.visible;
+  }
+
+  int bodies[2][2] = { { first[TILES_PLAIN], first[TILES_FRAGILE] }, { first[TILES_FRAGILE], first[TILE_KINDS] } };
+  bool resting = fs.wave_mode==WAVE_NONE;
+  bool bottoms = bottomsVisible(fs.VP);
+  for(int b=0;b<2;b++)
+  {
+    VAO *top = b ? stage.rect4 : stage.rect1;
+    // at rest only tiles off the wave are drawn one by one, the level is in the slab mesh.
+    // While the wave runs neighbours sit at different heights and every face can show
+    int from = resting ? loose[b][0] : bodies[b][0];
+    int to = resting ? loose[b][1] : bodies[b][1];
+    drawTileFace(top, src, from, to, FACE_TOP);
+    if(bottoms)
+      drawTileFace(top, src, from, to, FACE_BOTTOM);
+    for(int d=0;d<4;d++)
+      drawTileFace(wallMesh(b, FACE_WALL+d), src, from, to, FACE_WALL+d);
+    int count = b ? all[TILE_KINDS]-all[TILES_FRAGILE] : all[TILES_FRAGILE]-all[TILES_PLAIN];
+    render_stats.tile_triangles_all += (long)count*(2*top->NumVertices+4*stage.rect2->NumVertices)/3;
+  }
+
+  // switch and teleport markings, discs at the detail their size on screen needs
+  for(int c=0;c<2;c++)
+    drawTileFace(stage.rect3, src, first[TILES_CROSS], first[TILES_CROSS+1], FACE_CROSS+c);
+  render_stats.tile_triangles_all += (long)(all[TILES_CROSS+1]-all[TILES_CROSS])*2*stage.rect3->NumVertices/3;
+
+  uploadDiscs(fs, *tiles);
+  TileSource discs = { &tile_batch.disc_sorted, stream.buffer, tile_batch.disc_at };
+  src = discs;
+  const int *round = tile_batch.disc_first, *teleport = tile_batch.disc_first+CIRCLE_LODS;
+  for(int l=0;l<CIRCLE_LODS;l++)
+  {
+    VAO *disc = stage.circle_lod[l];
+    for(int h=0;h<2;h++)
+    {
+      drawTileFace(disc, src, round[l], round[l+1], FACE_DISC+h);
+      drawTileFace(disc, src, teleport[l], teleport[l+1], FACE_TELEPORT+h);
+    }
+
+    int halves = 2*(round[l+1]-round[l] + teleport[l+1]-teleport[l]);
+    render_stats.disc_triangles += halves*circle_segments[l];
+    render_stats.disc_triangles_full += halves*circle_segments[CIRCLE_LODS-1];
+    render_stats.tile_triangles_all += halves*circle_segments[l];
+  }
+  if(fast_path)
+    submitTileFaces();
+
+  if(resting && slab_mesh.first[3]>0)
+  {
+    glUseProgram(slab_shader.program);
+    glUniformMatrix4fv(slab_shader.VP, 1, GL_FALSE, &fs.VP[0][0]);
+    glUniform1f(slab_shader.height, fs.wave_zs);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray(slab_mesh.vao);
+
+    // runs of consecutive quads in view, all of them for the orthographic cameras
+    vector<GLint> starts;
+    vector<GLsizei> counts;
+    Frustum f = frustumOf(fs.VP);
+    glm::vec3 lift(0, 0, fs.wave_zs);
+    for(int part=0;part<3;part++)
+    {
+      if(part==1 && !bottoms)
+        continue;
+      for(int v=slab_mesh.first[part];v<slab_mesh.first[part+1];v+=6)
       {
-        drawCube(5+(cube1i-8)*10,5+(cube1j-5)*10,cube1k,0);
-        drawCube(5+(cube2i-8)*10,5+(cube2j-5)*10,cube2k,0);
+        int q = v/6;
+        if(!fs.ortho && boxInFrustum(f, slab_mesh.lo[q]+lift, slab_mesh.hi[q]+lift)==BOX_OUTSIDE)
+        {
+          render_stats.slab_quads_culled++;
+          continue;
+        }
+        if(!starts.empty() && starts.back()+counts.back()==v)
+          counts.back() += 6;
+        else
+        {
+          starts.push_back(v);
+          counts.push_back(6);
+        }
+        render_stats.tile_triangles += 2;
       }
-      if(flag_check==1)
-      {
-	 	stage.checkTouch(cube1i,cube1j,cube2i,cube2j);
-	 	flag_check=0;
-	  }
+    }
+    if(!starts.empty())
+    {
+      glMultiDrawArrays(GL_TRIANGLES, &starts[0], &counts[0], starts.size());
+      render_stats.drew(starts.size());
+    }
   }
 
-}block;
+  glUseProgram(programID);
+}
+
+struct CubeShader {
+  GLuint program, VP;
+  IndirectBatch indirect;
+} cube_shader;
+
+/* Draw every recorded cube in one instanced call - render thread only, leaves programID in use */
+void renderCubes(const FrameState &fs)
+{
+  if(fs.cubes.empty())
+    return;
+
+  glUseProgram(cube_shader.program);
+  glUniformMatrix4fv(cube_shader.VP, 1, GL_FALSE, &fs.VP[0][0]);
+
+  VAO *mesh = block.cube;
+  if(fast_path)
+  {
+    if(cube_shader.indirect.vao==0)
+    {
+      static const GLuint attribs[3][3] = {
+        { 2, 3, offsetof(CubeDraw, x) }, { 3, 4, offsetof(CubeDraw, axis) }, { 4, 3, offsetof(CubeDraw, pivot) },
+      };
+      cube_shader.indirect.create(attribs, 3);
+    }
+    cube_shader.indirect.add(mesh, 0, fs.cubes.size());
+    render_stats.drew(cube_shader.indirect.submit(&fs.cubes[0], fs.cubes.size()*sizeof(CubeDraw), sizeof(CubeDraw)));
+    glUseProgram(programID);
+    return;
+  }
+  glPolygonMode (GL_FRONT_AND_BACK, mesh->FillMode);
+  glBindVertexArray (mesh->VertexArrayID);
+  size_t at = stream.write(&fs.cubes[0], fs.cubes.size()*sizeof(CubeDraw));
+  glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(CubeDraw), (void*)(at+offsetof(CubeDraw, x)));
+  glVertexAttribDivisor(2, 1);
+  glEnableVertexAttribArray(3);
+  glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(CubeDraw), (void*)(at+offsetof(CubeDraw, axis)));
+  glVertexAttribDivisor(3, 1);
+  glEnableVertexAttribArray(4);
+  glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(CubeDraw), (void*)(at+offsetof(CubeDraw, pivot)));
+  glVertexAttribDivisor(4, 1);
+  glDrawArraysInstanced(mesh->PrimitiveMode, mesh->First, mesh->NumVertices, fs.cubes.size());
+  render_stats.drew(1);
+
+  glUseProgram(programID);
+}
 
 
 VAO *rect1,*rect2;
@@ -1802,6 +2846,398 @@ void createRectangle2()
 
 double x_g,y_g;
 
+#define INPUT_LOOKAHEAD 4
+
+enum { INPUT_MOVE, INPUT_CLICK, INPUT_HOVER_START, INPUT_HOVER_END, INPUT_SWITCH, INPUT_VIEW, INPUT_ZOOM };
+
+/* Input captured by the GLFW callbacks and consumed by processInput() */
+struct InputEvent {
+  int type;
+  int value;      // INPUT_MOVE: direction, same codes as Block::move_flag
+  double x,y;     // cursor position in normalised device coordinates, scroll offset for INPUT_ZOOM
+  double time;    // glfwGetTime() when the callback fired
+};
+
+SpscQueue<InputEvent, 256> input_queue;     // callbacks -> simulation
+InputEvent lookahead[INPUT_LOOKAHEAD];      // moves waiting for the block to become free
+int lookahead_count=0;
+
+/* Input-to-photon latency. Every input is followed from the callback
+   until the swap of the first frame drawn after it took effect */
+struct LatencySample {
+  double input;          // callback fired
+  double applied;        // simulation acted on it
+  double render_start;   // first frame reflecting it starts drawing
+  double render_end;
+  double swap_end;       // ... and is on screen
+};
+
+class LatencyTracker {
+  vector<AppliedInput> pending;     // simulation thread - applied, not yet published
+  vector<LatencySample> samples;    // render thread
+  std::atomic<int> dropped;
+
+  static void percentiles(const char *name, vector<double> values)
+  {
+    if(values.empty())
+      return;
+    sort(values.begin(), values.end());
+    int n = values.size();
+    printf("  %-10s p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms\n", name,
+           1000*values[n/2], 1000*values[n*9/10], 1000*values[min(n-1,n*99/100)], 1000*values[n-1]);
+  }
+
+public:
+  bool enabled;
+
+  LatencyTracker() : dropped(0), enabled(false) {}
+
+  void applied(double input_time)
+  {
+    if(!enabled)
+      return;
+    AppliedInput a = { input_time, glfwGetTime() };
+    pending.push_back(a);
+  }
+
+  void drop()
+  {
+    dropped++;
+  }
+
+  /* Simulation thread: attach what was applied this tick to the state being built */
+  void collect(vector<AppliedInput> &inputs)
+  {
+    inputs.insert(inputs.end(), pending.begin(), pending.end());
+    pending.clear();
+  }
+
+  /* Render thread: a frame built from these inputs has been swapped */
+  void frame(const vector<AppliedInput> &inputs, double render_start, double render_end, double swap_end)
+  {
+    for(size_t i=0;i<inputs.size();i++)
+    {
+      LatencySample s = { inputs[i].input, inputs[i].applied, render_start, render_end, swap_end };
+      samples.push_back(s);
+    }
+  }
+
+  void report()
+  {
+    if(!enabled)
+      return;
+    vector<double> queue, sim, render, swap, total;
+    for(size_t i=0;i<samples.size();i++)
+    {
+      LatencySample &s = samples[i];
+      queue.push_back(s.applied-s.input);
+      sim.push_back(s.render_start-s.applied);
+      render.push_back(s.render_end-s.render_start);
+      swap.push_back(s.swap_end-s.render_end);
+      total.push_back(s.swap_end-s.input);
+    }
+    printf("Input latency: %d events, %d dropped\n", (int)samples.size(), dropped.load());
+    percentiles("queue", queue);
+    percentiles("simulate", sim);
+    percentiles("render", render);
+    percentiles("swap", swap);
+    percentiles("total", total);
+  }
+} latency;
+
+/* Frame capture. The finished back buffer is read into a ring of pixel buffer
+   objects and mapped a frame or two later, once its fence has passed, so the
+   render thread never waits on the GPU. A writer thread turns the pixels into
+   a Y4M video (--capture file.y4m) or numbered PPM images (--capture name.ppm),
+   and F12 saves a PPM screenshot. When either side falls behind the frame is
+   dropped and counted rather than waited for */
+#define CAPTURE_PBOS 3
+#define CAPTURE_FRAMES 8      // pixel copies on their way to the writer, a power of two
+
+enum { CAPTURE_VIDEO=1, CAPTURE_SEQUENCE=2, CAPTURE_SCREENSHOT=4 };
+
+struct CaptureFrame {
+  vector<unsigned char> rgba;   // bottom row first, as GL reads it
+  int width, height;
+  int outputs;                  // CAPTURE_* bits
+  long number;
+};
+
+class FrameCapture {
+  GLuint pbo[CAPTURE_PBOS];
+  GLsync fence[CAPTURE_PBOS];
+  int width[CAPTURE_PBOS], height[CAPTURE_PBOS], outputs[CAPTURE_PBOS];
+  long number[CAPTURE_PBOS];
+  long bytes[CAPTURE_PBOS];     // storage of each PBO
+  int head, pending;            // next PBO to read into, reads not yet mapped
+
+  CaptureFrame frames[CAPTURE_FRAMES];
+  SpscQueue<CaptureFrame*, CAPTURE_FRAMES> full, empty;   // render thread -> writer -> render thread
+  std::thread writer;
+  std::atomic<bool> running;
+  FILE *video;
+  int video_width, video_height;
+
+  long grabbed, dropped_gpu, dropped_writer;
+  std::atomic<long> written, dropped_size, shots;
+  vector<double> cost;          // ms spent on the render thread, per captured frame
+
+  /* Hand every read whose fence has passed to the writer, or all of them if wait */
+  void collect(bool wait)
+  {
+    while(pending>0)
+    {
+      int p = (head-pending+CAPTURE_PBOS)%CAPTURE_PBOS;
+      GLenum r = glClientWaitSync(fence[p], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+      if(r==GL_TIMEOUT_EXPIRED)
+      {
+        if(wait)
+          continue;
+        break;
+      }
+      glDeleteSync(fence[p]);
+      fence[p] = 0;
+      pending--;
+
+      CaptureFrame *f;
+      if(!empty.pop(f))
+      {
+        dropped_writer++;
+        continue;
+      }
+      long size = (long)width[p]*height[p]*4;
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[p]);
+      const unsigned char *pixels = (const unsigned char *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+      if(pixels)
+      {
+        f->rgba.resize(size);
+        memcpy(&f->rgba[0], pixels, size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      f->width = width[p];
+      f->height = height[p];
+      f->outputs = outputs[p];
+      f->number = number[p];
+      if(!pixels)
+      {
+        // only the writer pushes to empty: send the frame along with nothing to write
+        f->outputs = 0;
+        dropped_gpu++;
+      }
+      full.push(f);     // cannot fail, there are only CAPTURE_FRAMES frames
+    }
+  }
+
+  static void writePpm(const char *name, const CaptureFrame &f)
+  {
+    FILE *out = fopen(name, "wb");
+    if(!out)
+    {
+      fprintf(stderr, "Capture: cannot write %s\n", name);
+      return;
+    }
+    fprintf(out, "P6\n%d %d\n255\n", f.width, f.height);
+    vector<unsigned char> row(f.width*3);
+    for(int y=f.height-1;y>=0;y--)
+    {
+      const unsigned char *src = &f.rgba[(long)y*f.width*4];
+      for(int x=0;x<f.width;x++)
+        memcpy(&row[x*3], src+x*4, 3);
+      fwrite(&row[0], 1, row.size(), out);
+    }
+    fclose(out);
+  }
+
+  /* One Y4M frame, full range BT.601 with 2x2 averaged chroma (C420jpeg) */
+  void writeY4m(const CaptureFrame &f)
+  {
+    if(video_width==0)
+    {
+      video_width = f.width;
+      video_height = f.height;
+      fprintf(video, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", f.width, f.height);
+    }
+    if(f.width!=video_width || f.height!=video_height)
+    {
+      dropped_size++;     // the stream has one size, a resized window stops adding to it
+      return;
+    }
+    int w = f.width, h = f.height, cw = (w+1)/2, ch = (h+1)/2;
+    vector<unsigned char> y(w*h), u(cw*ch), v(cw*ch);
+    for(int r=0;r<h;r++)
+    {
+      const unsigned char *src = &f.rgba[(long)(h-1-r)*w*4];
+      for(int x=0;x<w;x++)
+        y[r*w+x] = (77*src[x*4] + 150*src[x*4+1] + 29*src[x*4+2] + 128) >> 8;
+    }
+    for(int r=0;r<ch;r++)
+      for(int x=0;x<cw;x++)
+      {
+        int sum[3] = { 0, 0, 0 }, n = 0;
+        for(int dy=0;dy<2 && 2*r+dy<h;dy++)
+          for(int dx=0;dx<2 && 2*x+dx<w;dx++)
+          {
+            const unsigned char *px = &f.rgba[((long)(h-1-2*r-dy)*w + 2*x+dx)*4];
+            for(int c=0;c<3;c++)
+              sum[c] += px[c];
+            n++;
+          }
+        int R = sum[0]/n, G = sum[1]/n, B = sum[2]/n;
+        u[r*cw+x] = 128 + ((-43*R - 85*G + 128*B + 128) >> 8);
+        v[r*cw+x] = 128 + ((128*R - 107*G - 21*B + 128) >> 8);
+      }
+    fputs("FRAME\n", video);
+    fwrite(&y[0], 1, y.size(), video);
+    fwrite(&u[0], 1, u.size(), video);
+    fwrite(&v[0], 1, v.size(), video);
+  }
+
+  void write(const CaptureFrame &f)
+  {
+    char name[512];
+    if(f.outputs & CAPTURE_VIDEO)
+      writeY4m(f);
+    if(f.outputs & CAPTURE_SEQUENCE)
+    {
+      // name.ppm -> name-00042.ppm
+      snprintf(name, sizeof(name), "%.*s-%05ld.ppm", (int)path.size()-4, path.c_str(), f.number);
+      writePpm(name, f);
+    }
+    if(f.outputs & CAPTURE_SCREENSHOT)
+    {
+      snprintf(name, sizeof(name), "screenshot-%ld-%ld.ppm", (long)time(NULL), f.number);
+      writePpm(name, f);
+      printf("Capture: saved %s\n", name);
+      shots++;
+    }
+    written++;
+  }
+
+  void run()
+  {
+    while(1)
+    {
+      CaptureFrame *f;
+      if(!full.pop(f))
+      {
+        if(running)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(2));
+          continue;
+        }
+        if(!full.pop(f))    // stopped, and nothing was pushed before that
+          return;
+      }
+      if(f->outputs)
+        write(*f);
+      empty.push(f);
+    }
+  }
+
+public:
+  string path;                  // --capture
+  bool screenshot;              // F12 was pressed
+
+  FrameCapture() : head(0), pending(0), running(false), video(NULL), video_width(0), video_height(0),
+                   grabbed(0), dropped_gpu(0), dropped_writer(0), written(0), dropped_size(0), shots(0), screenshot(false)
+  {
+    for(int p=0;p<CAPTURE_PBOS;p++)
+    {
+      pbo[p] = 0;
+      fence[p] = 0;
+      bytes[p] = 0;
+    }
+  }
+
+  /* Render thread, after the frame is drawn and before it is swapped */
+  void frame()
+  {
+    bool video_frame = path!="";
+    if(!video_frame && !screenshot && pending==0)
+      return;
+    double t = glfwGetTime();
+    if(!running)
+    {
+      if(video_frame && path.size()>4 && !strcmp(path.c_str()+path.size()-4, ".y4m"))
+      {
+        video = fopen(path.c_str(), "wb");
+        if(!video)
+          fprintf(stderr, "Capture: cannot write %s\n", path.c_str());
+      }
+      for(int i=0;i<CAPTURE_FRAMES;i++)
+        empty.push(&frames[i]);
+      running = true;
+      writer = std::thread(&FrameCapture::run, this);
+    }
+
+    collect(false);
+    int outputs_now = (video ? CAPTURE_VIDEO : 0) | (video_frame && !video ? CAPTURE_SEQUENCE : 0) |
+                      (screenshot ? CAPTURE_SCREENSHOT : 0);
+    screenshot = false;
+    if(outputs_now)
+    {
+      if(pending==CAPTURE_PBOS)
+        dropped_gpu++;      // every PBO still being read into
+      else
+      {
+        int p = head;
+        long size = (long)fb_width*fb_height*4;
+        if(pbo[p]==0)
+          pbo[p] = gpu.buffer();
+        if(bytes[p]!=size)
+        {
+          gpu.bufferData(pbo[p], size, NULL, GL_STREAM_READ);
+          bytes[p] = size;
+        }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[p]);
+        glReadPixels(0, 0, fb_width, fb_height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        fence[p] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        width[p] = fb_width;
+        height[p] = fb_height;
+        outputs[p] = outputs_now;
+        number[p] = grabbed++;
+        head = (head+1)%CAPTURE_PBOS;
+        pending++;
+      }
+    }
+    cost.push_back((glfwGetTime()-t)*1000);
+  }
+
+  /* Render thread, before the context goes: write out what is still in flight */
+  void finish()
+  {
+    if(!running)
+      return;
+    collect(true);
+    running = false;
+    writer.join();
+    if(video)
+      fclose(video);
+    video = NULL;
+
+    vector<double> c = cost;
+    sort(c.begin(), c.end());
+    double sum=0;
+    for(size_t i=0;i<c.size();i++)
+      sum+=c[i];
+    printf("Capture: %ld frames read back, %ld written, %ld screenshots\n", grabbed, written.load(), shots.load());
+    printf("  dropped: %ld with the writer behind, %ld with the GPU behind, %ld after a resize\n",
+           dropped_writer, dropped_gpu, dropped_size.load());
+    if(!c.empty())
+      printf("  render thread: mean %.3f  p99 %.3f  max %.3f ms per frame\n", sum/c.size(),
+             c[min(c.size()-1, c.size()*99/100)], c.back());
+  }
+} capture;
+
+void pushInput(int type,int value,double x,double y)
+{
+  InputEvent ev = { type, value, x, y, glfwGetTime() };
+  input_queue.push(ev);   // a full ring drops the event, like a missed key press
+}
+
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -1835,97 +3271,28 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 quit(window);
                 break;
             case GLFW_KEY_LEFT:
-              if(flag_move==1 && flag_fall==0 && flag_fallcomp==0 && block.flag_animate==0)
-              {
-                if(flag_gameover==0 && stage.start_stage==0 && stage.end_stage==0)
-                {
-                block.move_flag=1;
-                	moves++;
-                block.flag_check=1;
-                block.flag_animate=1;
-                block.type=1;
-                flag_move=0;
-                }
-              }
+              pushInput(INPUT_MOVE,1,0,0);
               break;
             case GLFW_KEY_RIGHT:
-              if(flag_move==1 && flag_fall==0 && flag_fallcomp==0 && block.flag_animate==0)
-              {
-                if(flag_gameover==0 && stage.start_stage==0 && stage.end_stage==0)
-                {
-                	moves++;
-                block.move_flag=2;
-                block.type=2;
-                block.flag_check=1;
-                block.flag_animate=1;
-                flag_move=0;
-                }
-              }
+              pushInput(INPUT_MOVE,2,0,0);
               break;
             case GLFW_KEY_UP:
-              if(flag_move==1 && flag_fall==0 && flag_fallcomp==0 && block.flag_animate==0)
-              {
-                if(flag_gameover==0 && stage.start_stage==0 && stage.end_stage==0)
-                {
-                	moves++;
-                block.move_flag=3;
-                block.type=3;
-                block.flag_check=1;
-                block.flag_animate=1;
-                flag_move=0;
-
-                }
-              }
+              pushInput(INPUT_MOVE,3,0,0);
               break;
             case GLFW_KEY_DOWN:
-              if(flag_move==1 && flag_fall==0 && flag_fallcomp==0 && block.flag_animate==0)
-              {
-                if(flag_gameover==0 && stage.start_stage==0 && stage.end_stage==0)
-                {
-                	moves++;
-                block.move_flag=4;
-                block.type=4;
-                block.flag_check=1;
-                block.flag_animate=1;
-                flag_move=0;
-                }
-              }
+              pushInput(INPUT_MOVE,4,0,0);
               break;
             case GLFW_KEY_SPACE:
-            	if(flag_fall==0)
-            	{
-            		block.flag_blockOpt=(block.flag_blockOpt+1)%2;
-            	}
-            	break;
-
+              pushInput(INPUT_SWITCH,0,0,0);
+              break;
             case GLFW_KEY_V:
-            	v=(v+1)%6;
-            	if(v==0)
-            	{
-				  Matrices.view = glm::lookAt(glm::vec3(-22,-43,29), glm::vec3(-10,0,0), glm::vec3(0,0,1)); // preview view
-            	}	
-            	else if(v==1)
-            	{
-				  Matrices.view = glm::lookAt(glm::vec3(-10,0,29), glm::vec3(-10,0,0), glm::vec3(0,1,0)); // top view
-
-            	}
-            	else if(v==2)
-            	{
-				  Matrices.view = glm::lookAt(glm::vec3(-22,-43,19), glm::vec3(-10,0,0), glm::vec3(0,0,1)); // tower view            		
-            	}
-            	else if(v==3)             //block view
-            	{
-            		if(block.cube1i<=block.cube2i)
-				  		Matrices.view = glm::lookAt(glm::vec3((block.cube1i-8)*10,0,19), glm::vec3(-10,0,0), glm::vec3(0,0,1)); // top view            		
-     	       		else
-				  		Matrices.view = glm::lookAt(glm::vec3((block.cube2i-8)*10,0,19), glm::vec3(-10,0,0), glm::vec3(0,0,1)); // top view            		     	       			
-     	       	}
-     	       	else if(v==5)
-     	       	{
-     	       		x_g=-22;
-     	       		y_g=-43;
-     	       	}
-            	break;
+              pushInput(INPUT_VIEW,0,0,0);
+              break;
+            case GLFW_KEY_F12:
+              // redraw now, a still screen would not present another frame to grab
+              capture.screenshot = true;
+              force_redraw = 1;
+              break;
             default:
                 break;
         }
@@ -1946,141 +3313,388 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
   }
 }
 
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/* Cursor position in window coordinates to normalised device coordinates, whatever the window size */
+glm::vec2 cursorNdc(GLFWwindow *window, double x, double y)
+{
+  int width=1, height=1;
+  glfwGetWindowSize(window, &width, &height);
+  return glm::vec2(2*x/max(width,1)-1, 1-2*y/max(height,1));
+}
+
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+    double xpos,ypos;
+    glfwGetCursorPos(window, &xpos, &ypos);
+    glm::vec2 ndc = cursorNdc(window, xpos, ypos);
+    double x=ndc.x, y=ndc.y;
+    switch (button) {
+        case GLFW_MOUSE_BUTTON_LEFT:
+            if(action == GLFW_PRESS)
+              pushInput(INPUT_CLICK,0,x,y);
+            break;
+        case GLFW_MOUSE_BUTTON_RIGHT:
+            if (action == GLFW_RELEASE)
+              pushInput(INPUT_HOVER_END,0,x,y);
+            else if(action == GLFW_PRESS)
+              pushInput(INPUT_HOVER_START,0,x,y);
+            break;
+        default:
+            break;
+    }
+}
+
+void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+{
+  pushInput(INPUT_ZOOM,0,yoffset,0);
+}
+
+/* Block can accept a new move this tick */
+int blockReady()
+{
+  return flag_move==1 && flag_fall==0 && flag_fallcomp==0 && block.flag_animate==0
+    && flag_gameover==0 && stage.start_stage==0 && stage.end_stage==0;
+}
+
+/* Start rolling the block, direction as in Block::move_flag */
+void startMove(int direction)
+{
+  if(!block.canRoll(direction))
+    return;
+  moves++;
+  block.move_flag=direction;
+  block.type=direction;
+  block.flag_check=1;
+  block.flag_animate=1;
+  flag_move=0;
+  audio.play(SOUND_ROLL);
+}
+
+/* Fixed camera the HUD is drawn with, HUD units run -120..120 across and -100..100 up */
+glm::mat4 hudVP()
+{
+  glm::mat4 p = glm::ortho(-120.0f, 120.0f, -100.0f, 100.0f, 0.1f, 120.0f);
+  glm::mat4 view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+  return p * view;
+}
+
+/* A flat transform hierarchy. Every node comes after its parent, so one forward
+   pass brings the world matrices up to date, recomputing only nodes whose local
+   transform or an ancestor's changed. VP * world is then redone in a batch for
+   those nodes, or for all of them when VP itself changed */
+struct TransformTree {
+  vector<glm::mat4> local, world, clip;   // clip = VP * world
+  vector<int> parent;                      // -1 for a root
+  vector<unsigned char> dirty;             // local set since the last update
+  glm::mat4 VP;
+  bool vp_dirty;
+
+  TransformTree() : vp_dirty(true) {}
+
+  int size() const { return local.size(); }
+
+  int add(int up)
+  {
+    local.push_back(glm::mat4(1.0f));
+    world.push_back(glm::mat4(1.0f));
+    clip.push_back(glm::mat4(1.0f));
+    parent.push_back(up);
+    dirty.push_back(1);
+    return local.size()-1;
+  }
+
+  /* Keep the first n nodes */
+  void truncate(int n)
+  {
+    local.resize(n);
+    world.resize(n);
+    clip.resize(n);
+    parent.resize(n);
+    dirty.resize(n);
+  }
+
+  void setLocal(int node, const glm::mat4 &m)
+  {
+    local[node] = m;
+    dirty[node] = 1;
+  }
+
+  void setVP(const glm::mat4 &m)
+  {
+    if(memcmp(&m, &VP, sizeof(m)))
+    {
+      VP = m;
+      vp_dirty = true;
+    }
+  }
+
+  void update()
+  {
+    int n = size(), updated = 0;
+    for(int i=0;i<n;i++)
+    {
+      int up = parent[i];
+      if(up>=0 && dirty[up])
+        dirty[i] = 1;       // moves with its parent
+      if(!dirty[i])
+        continue;
+      world[i] = up>=0 ? world[up]*local[i] : local[i];
+      updated++;
+    }
+    for(int i=0;i<n;i++)
+      if(vp_dirty || dirty[i])
+        clip[i] = VP*world[i];
+    for(int i=0;i<n;i++)
+      dirty[i] = 0;
+    vp_dirty = false;
+    render_stats.transforms_updated += updated;
+    render_stats.transforms_reused += n-updated;
+  }
+};
+
+/* The near and far ends of the ray under a point on the screen, back through VP */
+void unproject(const glm::mat4 &VP, glm::vec2 ndc, glm::vec3 &from, glm::vec3 &to)
+{
+  glm::mat4 inv = glm::inverse(VP);
+  glm::vec4 a = inv * glm::vec4(ndc.x, ndc.y, -1, 1);
+  glm::vec4 b = inv * glm::vec4(ndc.x, ndc.y, 1, 1);
+  from = glm::vec3(a.x, a.y, a.z) / a.w;
+  to = glm::vec3(b.x, b.y, b.z) / b.w;
+}
+
+/* Cursor in HUD units */
+glm::vec2 hudPoint(glm::vec2 ndc)
+{
+  glm::vec3 from, to;
+  unproject(hudVP(), ndc, from, to);
+  return glm::vec2(from.x, from.y);
+}
+
+bool tileAt(int i,int j)
+{
+  if(i<0 || i>=15 || j<0 || j>=10)
+    return false;
+  int type = stage.stage[stage.level-1][i][j];
+  return type==1 || type==3 || type==4 || type==5 || type==6;
+}
+
+/* Grid cell under the cursor for the camera VP. The ray is cut to the slab the
+   resting tiles fill (z from 1 to 3 above the stage height) and the cells under
+   that stretch are walked in order (2D DDA); the first one holding a tile is hit
+   on its top or on the wall the ray comes in through. Missing every tile, the cell
+   where the ray crosses the tile tops is picked. False if the ray never comes down */
+bool pickCell(const glm::mat4 &VP, glm::vec2 ndc, int &ci, int &cj)
+{
+  glm::vec3 from, to;
+  unproject(VP, ndc, from, to);
+  glm::vec3 d = to-from;
+  if(d.z>=0)
+    return false;
+  float top = stage.zs+3, bottom = stage.zs+1;
+  float t0 = max((top-from.z)/d.z, 0.0f), t1 = (bottom-from.z)/d.z;
+  if(t1<=0)
+    return false;
+
+  // grid units: cell i spans [i, i+1) across, tile centres sit at initx+(i-8)*10
+  float gx = (from.x+d.x*t0-stage.initx)/10+8.5f, gy = (from.y+d.y*t0-stage.inity)/10+5.5f;
+  float dx = d.x/10, dy = d.y/10;
+  int i = (int)floor(gx), j = (int)floor(gy);
+  ci = i;
+  cj = j;
+  int step_i = dx>0 ? 1 : -1, step_j = dy>0 ? 1 : -1;
+  float next_i = dx!=0 ? ((dx>0 ? i+1 : i)-gx)/dx : INFINITY;   // ray parameter to the next cell edge
+  float next_j = dy!=0 ? ((dy>0 ? j+1 : j)-gy)/dy : INFINITY;
+  float delta_i = dx!=0 ? step_i/dx : INFINITY, delta_j = dy!=0 ? step_j/dy : INFINITY;
+  float left = t1-t0;
+  for(;;)
+  {
+    if(tileAt(i,j))
+    {
+      ci = i;
+      cj = j;
+      return true;
+    }
+    if(next_i<next_j)
+    {
+      if(next_i>left)
+        break;
+      i += step_i;
+      next_i += delta_i;
+    }
+    else
+    {
+      if(next_j>left)
+        break;
+      j += step_j;
+      next_j += delta_j;
+    }
+  }
+  return true;
+}
+
+/* Direction of the click-to-move target around the selected group, 0 if the click missed */
+int clickDirection(double x,double y)
+{
+  int i0,i1,j0,j1;
+  block.bounds(block.group[block.flag_blockOpt],i0,i1,j0,j1);
+  bool across_i = x<=10+(i1-8)*10 && x>=(i0-8)*10;
+  bool across_j = y<=10+(j1-5)*10 && y>=(j0-5)*10;
+  if(y>=10+(j1-5)*10)
+    return across_i ? 3 : 0;
+  else if(y<=(j0-5)*10)
+    return across_i ? 4 : 0;
+  else if(x<=(i0-8)*10)
+    return across_j ? 1 : 0;
+  else if(x>=10+(i1-8)*10)
+    return across_j ? 2 : 0;
+  return 0;
+}
+
+void cycleView()
+{
+  v=(v+1)%6;
+  if(v==0)
+  {
+    Matrices.view = glm::lookAt(glm::vec3(-22,-43,29), glm::vec3(-10,0,0), glm::vec3(0,0,1)); // preview view
+  }
+  else if(v==1)
+  {
+    Matrices.view = glm::lookAt(glm::vec3(-10,0,29), glm::vec3(-10,0,0), glm::vec3(0,1,0)); // top view
+  }
+  else if(v==2)
+  {
+    Matrices.view = glm::lookAt(glm::vec3(-22,-43,19), glm::vec3(-10,0,0), glm::vec3(0,0,1)); // tower view
+  }
+  else if(v==3)             //block view
+  {
+    int i0,i1,j0,j1;
+    block.bounds(block.group[block.flag_blockOpt],i0,i1,j0,j1);
+    Matrices.view = glm::lookAt(glm::vec3((i0-8)*10,0,19), glm::vec3(-10,0,0), glm::vec3(0,0,1));
+  }
+  else if(v==5)
+  {
+    x_g=-22;
+    y_g=-43;
+  }
+}
+
+/* Take the next queued moves and piece switches out of the lookahead buffer if the block is free */
+void runLookahead()
+{
+  while(lookahead_count>0 && blockReady())
+  {
+    InputEvent ev = lookahead[0];
+    lookahead_count--;
+    for(int i=0;i<lookahead_count;i++)
+      lookahead[i]=lookahead[i+1];
+
+    if(ev.type==INPUT_MOVE)
+      startMove(ev.value);
+    else if(ev.type==INPUT_SWITCH)
+    {
+      if(flag_fall==0)
+        block.selectNext();
+    }
+    else
+    {
+      // the clicked cell, by its centre as clickDirection expects
+      int i, j, direction = 0;
+      if(pickCell(Matrices.projection*Matrices.view, glm::vec2(ev.x, ev.y), i, j))
+        direction = clickDirection((i-8)*10+5, (j-5)*10+5);
+      if(direction!=0 && block.canRoll(direction))
+      {
+        block.move_flag=direction;
+        flag_move=0;
+        block.flag_check=1;
+      }
+    }
+    latency.applied(ev.time);
+  }
+}
+
+/* Drain the input ring at a simulation tick boundary */
+void processInput()
 {
-    switch (button) {
-        case GLFW_MOUSE_BUTTON_LEFT:
-            if (action == GLFW_RELEASE)
-            {
-
-            }
-            else if(action == GLFW_PRESS)
-            {
-                glfwGetCursorPos(window, &xpos, &ypos);
-                x_g=(xpos-400)*1.0*3/10;
-                y_g=(350-ypos)*1.0/3.5;
-                if(flag_gameover==0)
-                {
-					if(x_g>=-118 && x_g<=-104 && y_g>=88 && y_g<=98)
-					{
-						flag_gameover=1;
-						flag_gamestart=1;
-					}
-					else if(flag_move==1)
-					{
-						if(y_g>=10+(block.cube1j-5)*10 && y_g>=10+(block.cube2j-5)*10)
-						{
-							if(block.cube1i>=block.cube2i && x_g<=10+(block.cube1i-8)*10 && x_g>=(block.cube2i-8)*10)
-							{
-							block.move_flag=3;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-
-							}
-							else if(block.cube2i>block.cube1i && x_g<=10+(block.cube2i-8)*10 && x_g>=(block.cube1i-8)*10)
-							{
-							block.move_flag=3;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-
-							}
-						}
-						else if(y_g<=(block.cube1j-5)*10 && y_g<=(block.cube2j-5)*10)
-						{
-							if(block.cube1i>=block.cube2i && x_g<=10+(block.cube1i-8)*10 && x_g>=(block.cube2i-8)*10)
-							{
-							block.move_flag=4;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-
-							}
-							else if(block.cube2i>block.cube1i && x_g<=10+(block.cube2i-8)*10 && x_g>=(block.cube1i-8)*10)
-							{
-							block.move_flag=4;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-								
-							}
-						}
-						else if(x_g<=(block.cube1i-8)*10 && x_g<=(block.cube2i-8)*10)
-						{
-							if(block.cube1j>=block.cube2j && y_g<=10+(block.cube1j-5)*10 && y_g>=(block.cube2j-5)*10)
-							{
-							block.move_flag=1;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-							}
-							else if(block.cube1j<block.cube2j && y_g<=10+(block.cube2j-5)*10 && y_g>=(block.cube1j-5)*10)
-							{
-							block.move_flag=1;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-
-							}
-						}
-						else if(x_g>=10+(block.cube1i-8)*10 && x_g>=10+(block.cube2i-8)*10)
-						{
-							if(block.cube1j>=block.cube2j && y_g<=10+(block.cube1j-5)*10 && y_g>=(block.cube2j-5)*10)
-							{
-							block.move_flag=2;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-							}
-							else if(block.cube1j<block.cube2j && y_g<=10+(block.cube2j-5)*10 && y_g>=(block.cube1j-5)*10)
-							{
-							block.move_flag=2;
-							flag_move=0;
-							block.flag_check=1;
-//							block.flag_animate=1;
-
-							}
-						}
-					}                	
-                }
-                else if(flag_gameover==1 && flag_gamestart==0)
-                {
-                	if(x_g>=-6 && x_g<=8 && y_g>=-18 && y_g<=-8)
-                	{
-                		flag_gamestart=1;
-                	}
-                }
-
-
-            }
-            break;
-        case GLFW_MOUSE_BUTTON_RIGHT:
-            if (action == GLFW_RELEASE) {
-            	flag_hover=0;
-            }
-            else if(action == GLFW_PRESS)
-            {
-                glfwGetCursorPos(window, &xpos, &ypos);
-                x_g=(xpos-400)*1.0*3/10;
-                y_g=(350-ypos)*1.0/3.5;
-            	flag_hover=1;
-            }
-            break;
-        default:
-            break;
+  InputEvent ev;
+  while(input_queue.pop(ev))
+  {
+    switch(ev.type)
+    {
+      case INPUT_MOVE:
+        if(lookahead_count<INPUT_LOOKAHEAD)
+          lookahead[lookahead_count++]=ev;
+        else
+          latency.drop();
+        break;
+      case INPUT_CLICK:
+      {
+        glm::vec2 hud = hudPoint(glm::vec2(ev.x, ev.y));
+        x_g=hud.x;
+        y_g=hud.y;
+        if(flag_gameover==0)
+        {
+          if(x_g>=-118 && x_g<=-104 && y_g>=88 && y_g<=98)
+          {
+            flag_gameover=1;
+            flag_gamestart=1;
+            latency.applied(ev.time);
+          }
+          else if(lookahead_count<INPUT_LOOKAHEAD)
+            lookahead[lookahead_count++]=ev;
+          else
+            latency.drop();
+        }
+        else if(flag_gameover==1 && flag_gamestart==0 && x_g>=-6 && x_g<=8 && y_g>=-18 && y_g<=-8)
+        {
+          flag_gamestart=1;
+          latency.applied(ev.time);
+        }
+        else
+          latency.drop();     // missed the start button, or a restart is already under way
+        break;
+      }
+      case INPUT_HOVER_START:
+      {
+        glm::vec2 hud = hudPoint(glm::vec2(ev.x, ev.y));
+        x_g=hud.x;
+        y_g=hud.y;
+        flag_hover=1;
+        break;
+      }
+      case INPUT_HOVER_END:
+        flag_hover=0;
+        break;
+      case INPUT_SWITCH:
+        // queued with the moves, so it cannot overtake one typed before it
+        if(lookahead_count<INPUT_LOOKAHEAD)
+          lookahead[lookahead_count++]=ev;
+        else
+          latency.drop();
+        break;
+      case INPUT_VIEW:
+        cycleView();
+        latency.applied(ev.time);
+        break;
+      case INPUT_ZOOM:
+        if(ev.x>0 && zoom<40)
+          zoom+=ev.x*2;
+        if(ev.x<0 && zoom>=2)
+          zoom+=ev.x*2;
+        Matrices.projection = glm::ortho(-120.0f+zoom, 120.0f-zoom, -100.0f+zoom, 100.0f-zoom, 0.1f, 120.0f);
+        latency.applied(ev.time);
+        break;
     }
-}
+  }
 
-void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
-{
-  if(yoffset>0 && zoom<40)
-    zoom+=yoffset*2;
-  if(yoffset<0 && zoom>=2)
-    zoom+=yoffset*2;
-    Matrices.projection = glm::ortho(-120.0f+zoom, 120.0f-zoom, -100.0f+zoom, 100.0f-zoom, 0.1f, 120.0f);
+  // queued moves were meant for a block that is no longer in play
+  if(flag_fall==1 || flag_fallcomp==1 || flag_gameover==1 || stage.start_stage==1 || stage.end_stage==1)
+  {
+    for(int i=0;i<lookahead_count;i++)
+      latency.drop();
+    lookahead_count=0;
+  }
 
+  runLookahead();
 }
 
 
@@ -2097,6 +3711,9 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 
   // sets the viewport of openGL renderer
   glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+  fb_width=fbwidth;
+  fb_height=fbheight;
+  force_redraw=1;
 
   // set the projection matrix as perspective
   /* glMatrixMode (GL_PROJECTION);
@@ -2106,80 +3723,166 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     // Perspective projection for 3D views
 //     Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
 
-    // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(-120.0f+zoom, 120.0f-zoom, -100.0f+zoom, 100.0f-zoom, 0.1f, 120.0f);
+    // Ortho projection for 2D views is rebuilt by the simulation thread every tick
 }
 
+/* Executed when the window contents need to be redrawn (e.g. after being uncovered) */
+void refreshWindow (GLFWwindow*)
+{
+  force_redraw=1;
+}
 
-void draw_rect(float x,float y,float rotation)
+
+/* HUD quads. Each one drawn is a node of transforms, in drawing order, that keeps
+   its matrices while the quad stays where it was the frame before. Their MVPs go
+   through the stream buffer and are drawn by flushHud as instances, in one call
+   on the fast path and one per run of the same mesh otherwise */
+struct HudPlacement {
+  VAO *mesh;
+  int parent;
+  float x, y, rotation;
+};
+
+struct HudBatch {
+  GLuint program;
+  IndirectBatch indirect;
+  TransformTree transforms;
+  vector<HudPlacement> placed;    // per node, what its local transform was made from
+  int next;                       // nodes used so far this frame
+  HudBatch() : program(0), next(0) {}
+} hud_batch;
+
+/* Translation by x,y after a turn of rotation degrees about z, the sines of the
+   few angles the HUD uses looked up rather than recomputed */
+glm::mat4 hudModel(float x, float y, float rotation)
 {
-	glm::mat4 VP1,view1,p;
-    p = glm::ortho(-120.0f, 120.0f, -100.0f, 100.0f, 0.1f, 120.0f);
-    view1 = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  	VP1 = p * view1;
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 rotateRect = glm::rotate((float)(rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-    glm::mat4 transRect = glm::translate (glm::vec3(x,y,0));
-    Matrices.model *= transRect*rotateRect;
-    MVP = VP1 * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
-    draw3DObject(rect1);
+  static vector<glm::vec3> turns;   // angle, cos, sin
+  glm::mat4 m(1.0f);
+  if(rotation!=0)
+  {
+    size_t t=0;
+    while(t<turns.size() && turns[t].x!=rotation)
+      t++;
+    if(t==turns.size())
+      turns.push_back(glm::vec3(rotation, cos(rotation*M_PI/180.0f), sin(rotation*M_PI/180.0f)));
+    m[0][0] = turns[t].y;
+    m[0][1] = turns[t].z;
+    m[1][0] = -turns[t].z;
+    m[1][1] = turns[t].y;
+  }
+  m[3][0] = x;
+  m[3][1] = y;
+  return m;
+}
 
+/* Draw mesh at x,y turned by rotation degrees, inside parent (a node from an earlier
+   call this frame, or -1 for the HUD itself). Returns the quad's node */
+int drawHud(VAO *mesh, float x, float y, float rotation, int parent=-1)
+{
+  HudBatch &b = hud_batch;
+  int node = b.next++;
+  HudPlacement p = { mesh, parent, x, y, rotation };
+  if(node==b.transforms.size())
+  {
+    b.transforms.add(parent);
+    b.placed.push_back(p);
+    b.transforms.setLocal(node, hudModel(x, y, rotation));
+  }
+  else if(memcmp(&p, &b.placed[node], sizeof(p)))
+  {
+    b.placed[node] = p;
+    b.transforms.parent[node] = parent;
+    b.transforms.setLocal(node, hudModel(x, y, rotation));
+  }
+  b.indirect.add(mesh, node, 1);
+  return node;
 }
 
-void draw_boxes(int flag)
+void flushHud()
+{
+  HudBatch &b = hud_batch;
+  if(b.next==0)
+    return;
+  b.transforms.truncate(b.next);
+  b.placed.resize(b.next);
+  b.next = 0;
+  static const glm::mat4 VP = hudVP();
+  b.transforms.setVP(VP);
+  b.transforms.update();
+  const vector<glm::mat4> &instances = b.transforms.clip;
+
+  glUseProgram(b.program);
+  if(!fast_path)
+  {
+    size_t at = stream.write(&instances[0], instances.size()*sizeof(glm::mat4));
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray(gpu.mesh_array);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+    vector<DrawArraysIndirectCommand> &list = hud_batch.indirect.list;
+    for(size_t c=0;c<list.size();c++)
+    {
+      size_t base = at + list[c].baseInstance*sizeof(glm::mat4);
+      for(int col=0;col<4;col++)
+      {
+        glEnableVertexAttribArray(2+col);
+        glVertexAttribPointer(2+col, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(base+col*4*sizeof(float)));
+        glVertexAttribDivisor(2+col, 1);
+      }
+      glDrawArraysInstanced(GL_TRIANGLES, list[c].first, list[c].count, list[c].instanceCount);
+      render_stats.drew(1);
+    }
+    list.clear();
+    glUseProgram(programID);
+    return;
+  }
+  if(hud_batch.indirect.vao==0)
+  {
+    static const GLuint attribs[4][3] = {   // a mat4 takes a location per column
+      { 2, 4, 0 }, { 3, 4, 4*sizeof(float) }, { 4, 4, 8*sizeof(float) }, { 5, 4, 12*sizeof(float) },
+    };
+    hud_batch.indirect.create(attribs, 4);
+  }
+  render_stats.drew(b.indirect.submit(&instances[0], instances.size()*sizeof(glm::mat4), sizeof(glm::mat4)));
+  glUseProgram(programID);
+}
+
+void draw_rect(float x,float y,float rotation)
 {
-  glm::mat4 rotateRect,transRect;
-	glm::mat4 VP1,view1,p;
-    p = glm::ortho(-120.0f, 120.0f, -100.0f, 100.0f, 0.1f, 120.0f);
-    view1 = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  	VP1 = p * view1;
+    drawHud(rect1, x, y, rotation);
+}
 
+void draw_boxes(int flag)
+{
   float x,y;
   if(flag==1)
   {
     x=-111;
     y=93;
-
-    Matrices.model = glm::mat4(1.0f);
-    rotateRect = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); 
-    transRect = glm::translate (glm::vec3(x,y,0));
-    Matrices.model *= transRect*rotateRect;
-    MVP = VP1 * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
-    draw3DObject(rect2);
-    draw_rect(x-2,y,90);
-    draw_rect(x-2+2*cos(30.0*M_PI/180),y+1,-30);
-    draw_rect(x-2+2*cos(30.0*M_PI/180),y-2*cos(60.0*M_PI/180),30);
-
   }
   else if(flag==2)
   {
     x=1;
     y=-13;
-
-    Matrices.model = glm::mat4(1.0f);
-    rotateRect = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); 
-    transRect = glm::translate (glm::vec3(x,y,0));
-    Matrices.model *= transRect*rotateRect;
-    MVP = VP1 * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
-    draw3DObject(rect2);
-    draw_rect(x-2,y,90);
-    draw_rect(x-2+2*cos(30.0*M_PI/180),y+1,-30);
-    draw_rect(x-2+2*cos(30.0*M_PI/180),y-2*cos(60.0*M_PI/180),30);
-
   }
+  else
+    return;
+
+  // the box, and the arrow in it placed relative to the box
+  static const float arrow_x = -2+2*cos(30.0*M_PI/180), arrow_y = -2*cos(60.0*M_PI/180);
+  int box = drawHud(rect2, x, y, 0);
+  drawHud(rect1, -2, 0, 90, box);
+  drawHud(rect1, arrow_x, 1, -30, box);
+  drawHud(rect1, arrow_x, arrow_y, 30, box);
 }
 
-void draw_score(int flag)
+void draw_score(int flag, const FrameState &fs)
 {
   int value,value2,shift=6,flag2=0,i;
   i=0;
   float x=115,y;
   if(flag==0||flag==2)
   {
-  value=moves;
+  value=fs.moves;
   y=70;
   if(value<0)
   {
@@ -2189,35 +3892,35 @@ void draw_score(int flag)
   }
   else if(flag==1)
   {
-    value=miss_limit-miss;
+    value=fs.misses_left;
     y=50;
   }
   else if(flag==3)
   {
-    value=stage.level;
+    value=fs.level;
     y=30;
   }
   else if(flag==4)
   {
-  	value=timemin;
+  	value=fs.timemin;
   	x=-90;
   	y=90;
   }
   else if(flag==5)
   {
-  	value=timesec;
+  	value=fs.timesec;
   	x=-75;
   	y=90;
   }
   else if(flag==6)
   {
-  	value=timemin;
+  	value=fs.timemin;
   	x=0;
   	y=-30;
   }
   else if(flag==7)
   {
-  	value=timesec;
+  	value=fs.timesec;
   	x=15;
   	y=-30;
   }
@@ -2448,16 +4151,11 @@ float camera_rotation_angle = 90;
 
 
 
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw (double x,double y)
+/* Advance the game by one tick and record what to draw into sim_frame */
+/* Runs on the simulation thread - no GL calls in here */
+void simulate (double x,double y)
 {
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
+  FrameState &fs = *sim_frame;
 
   // Eye - Location of camera. Don't change unless you are sure!!
 //  glm::vec3 eye (-22, -43, 29 );
@@ -2492,38 +4190,18 @@ void draw (double x,double y)
     else if(v==3)   //block view
     {
 	     Matrices.projection = glm::perspective ((GLfloat)90.0f, (GLfloat) 800 / (GLfloat) 700, 0.1f, 500.0f);
-        if(flag_stand==1)
-        {
-			Matrices.view = glm::lookAt(glm::vec3(15+(block.cube1i-8)*10,5+(block.cube1j-5)*10,11), glm::vec3(60,0,0), glm::vec3(0,0,1)); // top view            		
-        }
-     	else if(flag_attach==1)
-     	{
-     		if(block.cube1i<block.cube2i)
-		  		Matrices.view = glm::lookAt(glm::vec3(15+(block.cube2i-8)*10,5+(block.cube2j-5)*10,7), glm::vec3(60,0,0), glm::vec3(0,0,1)); // top view            		     	       			    
-    		else if(block.cube1i>block.cube2i)
-		  		Matrices.view = glm::lookAt(glm::vec3(15+(block.cube1i-8)*10,5+(block.cube1j-5)*10,7), glm::vec3(60,0,0), glm::vec3(0,0,1)); // top view            		     	       			    
-			else
-		  		Matrices.view = glm::lookAt(glm::vec3(15+(block.cube1i-8)*10,(5+((block.cube1j+block.cube2j)/2.0-5)*10),7), glm::vec3(60,0,0), glm::vec3(0,0,1)); // top view            		     	       			    
-
-     	}
+	     int fi;
+	     float fj;
+	     block.front(fi,fj);
+	     Matrices.view = glm::lookAt(glm::vec3(15+(fi-8)*10,5+(fj-5)*10,flag_stand==1 ? 11 : 7), glm::vec3(60,0,0), glm::vec3(0,0,1)); // top view
      }
     else if(v==4)   //follow-block view
     {
 	     Matrices.projection = glm::perspective ((GLfloat)90.0f, (GLfloat) 800 / (GLfloat) 700, 0.1f, 500.0f);
-        if(flag_stand==1)
-        {
-			Matrices.view = glm::lookAt(glm::vec3((block.cube1i-8)*10-10,-5+(block.cube1j-5)*10,20), glm::vec3(60,0,8), glm::vec3(0,0,1)); // top view            		
-        }
-     	else if(flag_attach==1)
-     	{
-     		if(block.cube1i<block.cube2i)
-		  		Matrices.view = glm::lookAt(glm::vec3((block.cube2i-8)*10-10,5+(block.cube2j-5)*10,20), glm::vec3(60,0,8), glm::vec3(0,0,1)); // top view            		     	       			    
-    		else if(block.cube1i>block.cube2i)
-		  		Matrices.view = glm::lookAt(glm::vec3((block.cube1i-8)*10-10,5+(block.cube1j-5)*10,20), glm::vec3(60,0,8), glm::vec3(0,0,1)); // top view            		     	       			    
-			else
-		  		Matrices.view = glm::lookAt(glm::vec3((block.cube1i-8)*10-10,(5+((block.cube1j+block.cube2j)/2.0-5)*10),20), glm::vec3(60,0,8), glm::vec3(0,0,1)); // top view            		     	       			    
-
-     	}
+	     int fi;
+	     float fj;
+	     block.front(fi,fj);
+	     Matrices.view = glm::lookAt(glm::vec3((fi-8)*10-10,(flag_stand==1 ? -5 : 5)+(fj-5)*10,20), glm::vec3(60,0,8), glm::vec3(0,0,1)); // top view
 	}
 	else if(v==5)  //helicopter view
 	{
@@ -2548,13 +4226,9 @@ void draw (double x,double y)
   // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
   //  Don't change unless you are sure!!
   VP = Matrices.projection * Matrices.view;
-
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-
-  // Load identity to model matrix
-  Matrices.model = glm::mat4(1.0f);
+  fs.VP = VP;
+  fs.ortho = v<=2;
+  fs.valid = true;
 
   /* Render your scene */
    if(flag_gameover ==1)
@@ -2583,42 +4257,369 @@ void draw (double x,double y)
  		change_time = glfwGetTime();
         
         flag_gamestart=0;
+        fs.hud = HUD_NONE;
         return;
       }
-      else
+      fs.hud = HUD_GAMEOVER;
+  }
+  else
+    fs.hud = HUD_GAME;
+
+  fs.moves = moves;
+  fs.misses_left = miss_limit-miss;
+  fs.level = stage.level;
+  fs.timemin = timemin;
+  fs.timesec = timesec;
+  if(flag_gameover==1)
+    return;
+
+  stage.animateStage();
+  block.animateCube();
+}
+
+/* Offscreen copy of the last rendered 3D scene. With a fixed camera and
+   nothing moving, frames only need the copy blitted and the HUD on top.
+   It is also the persistent buffer dirty rectangles are redrawn into */
+struct SceneCache {
+  GLuint fbo, color, depth;
+  int width, height;
+  uint64_t signature;
+  bool valid;
+  glm::mat4 VP;               // what the cached image was drawn from
+  int wave_mode;
+  float wave_zs;
+  vector<TileDraw> tiles;
+  vector<CubeDraw> cubes;
+  SceneCache() : fbo(0), color(0), depth(0), width(0), height(0), signature(0), valid(false), wave_mode(WAVE_NONE), wave_zs(0) {}
+} scene_cache;
+
+/* Framebuffer pixel rectangle, x1/y1 exclusive */
+struct ScreenRect {
+  int x0,y0,x1,y1;
+  int area() const { return (x1-x0)*(y1-y0); }
+  bool overlaps(const ScreenRect &r) const { return x0<r.x1 && r.x0<x1 && y0<r.y1 && r.y0<y1; }
+};
+
+void resizeSceneCache(int width,int height)
+{
+  if(scene_cache.fbo==0)
+  {
+    scene_cache.fbo = gpu.framebuffer();
+    scene_cache.color = gpu.renderbuffer();
+    scene_cache.depth = gpu.renderbuffer();
+  }
+  gpu.renderbufferStorage(scene_cache.color, GL_RGBA8, width, height, 4);
+  gpu.renderbufferStorage(scene_cache.depth, GL_DEPTH_COMPONENT24, width, height, 4);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, scene_cache.fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, scene_cache.color);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, scene_cache.depth);
+  if(glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE)
+    fprintf(stderr, "Scene cache framebuffer incomplete\n");
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  scene_cache.width = width;
+  scene_cache.height = height;
+  scene_cache.valid = false;
+}
+
+/* Screen bounds of the box lo..hi transformed by M (VP * model), padded for rasterisation */
+ScreenRect projectBox(const glm::mat4 &M, const float lo[3], const float hi[3])
+{
+  ScreenRect r = { fb_width, fb_height, 0, 0 };
+  for(int c=0;c<8;c++)
+  {
+    glm::vec4 p = M * glm::vec4(c&1 ? hi[0] : lo[0], c&2 ? hi[1] : lo[1], c&4 ? hi[2] : lo[2], 1);
+    if(p.w<=0)
+    {
+      ScreenRect all = { 0, 0, fb_width, fb_height };
+      return all;
+    }
+    float x = (p.x/p.w*0.5f+0.5f)*fb_width;
+    float y = (p.y/p.w*0.5f+0.5f)*fb_height;
+    r.x0 = min(r.x0, (int)floor(x)-2);
+    r.y0 = min(r.y0, (int)floor(y)-2);
+    r.x1 = max(r.x1, (int)ceil(x)+2);
+    r.y1 = max(r.y1, (int)ceil(y)+2);
+  }
+  r.x0 = max(r.x0, 0);
+  r.y0 = max(r.y0, 0);
+  r.x1 = min(r.x1, fb_width);
+  r.y1 = min(r.y1, fb_height);
+  if(r.x1<r.x0) r.x1=r.x0;
+  if(r.y1<r.y0) r.y1=r.y0;
+  return r;
+}
+
+ScreenRect tileRect(const TileDraw &t, const FrameState &fs)
+{
+  // walls from z+1, switch overlays reach z+3.2
+  float z = waveHeight(t, fs.wave_mode, fs.wave_zs);
+  float lo[3] = { t.x-5, t.y-5, z+1 };
+  float hi[3] = { t.x+5, t.y+5, z+3.2f };
+  return projectBox(fs.VP, lo, hi);
+}
+
+ScreenRect cubeRect(const CubeDraw &c, const glm::mat4 &VP)
+{
+  float lo[3] = { -5, -5, 3 };
+  float hi[3] = { 5, 5, 13 };
+  return projectBox(VP*cubeModel(c), lo, hi);
+}
+
+template <typename T>
+bool bytesLess(const T &a, const T &b)
+{
+  return memcmp(&a, &b, sizeof(T))<0;
+}
+
+/* Items of a that are not in b, as a multiset */
+template <typename T>
+void itemsNotIn(vector<T> a, vector<T> b, vector<T> &out)
+{
+  sort(a.begin(), a.end(), bytesLess<T>);
+  sort(b.begin(), b.end(), bytesLess<T>);
+  size_t j=0;
+  for(size_t i=0;i<a.size();i++)
+  {
+    while(j<b.size() && bytesLess(b[j], a[i]))
+      j++;
+    if(j<b.size() && !bytesLess(a[i], b[j]))
+      j++;      // matched
+    else
+      out.push_back(a[i]);
+  }
+}
+
+/* Merge overlapping rectangles until none overlap */
+void mergeRects(vector<ScreenRect> &rects)
+{
+  bool merged=true;
+  while(merged)
+  {
+    merged=false;
+    for(size_t i=0;i<rects.size() && !merged;i++)
+      for(size_t j=i+1;j<rects.size() && !merged;j++)
+        if(rects[i].overlaps(rects[j]))
+        {
+          rects[i].x0 = min(rects[i].x0, rects[j].x0);
+          rects[i].y0 = min(rects[i].y0, rects[j].y0);
+          rects[i].x1 = max(rects[i].x1, rects[j].x1);
+          rects[i].y1 = max(rects[i].y1, rects[j].y1);
+          rects.erase(rects.begin()+j);
+          merged=true;
+        }
+  }
+}
+
+/* Screen areas that differ between the cached scene and fs. False if a full redraw is cheaper */
+bool dirtyRects(const FrameState &fs, vector<ScreenRect> &rects)
+{
+  if(!fs.ortho || memcmp(&fs.VP, &scene_cache.VP, sizeof(fs.VP)))
+    return false;   // camera moved, every pixel changes
+  if(fs.wave_mode!=scene_cache.wave_mode || fs.wave_zs!=scene_cache.wave_zs)
+    return false;   // the whole stage moved
+
+  vector<TileDraw> tiles;
+  vector<CubeDraw> cubes;
+  itemsNotIn(fs.tiles, scene_cache.tiles, tiles);
+  itemsNotIn(scene_cache.tiles, fs.tiles, tiles);
+  itemsNotIn(fs.cubes, scene_cache.cubes, cubes);
+  itemsNotIn(scene_cache.cubes, fs.cubes, cubes);
+
+  for(size_t i=0;i<tiles.size();i++)
+    rects.push_back(tileRect(tiles[i], fs));
+  for(size_t i=0;i<cubes.size();i++)
+    rects.push_back(cubeRect(cubes[i], fs.VP));
+  mergeRects(rects);
+
+  int area=0;
+  for(size_t i=0;i<rects.size();i++)
+    area+=rects[i].area();
+  return area*2 < fb_width*fb_height;
+}
+
+/* Leaves the tiles and cubes of fs in the default framebuffer, re-rendering
+   only what changed since the cached copy was made */
+void renderScene(const FrameState &fs)
+{
+  float touched = 0;
+
+  if(scene_cache.width!=fb_width || scene_cache.height!=fb_height)
+    resizeSceneCache(fb_width, fb_height);
+
+  if(!scene_cache.valid || scene_cache.signature!=fs.scene_signature)
+  {
+    vector<ScreenRect> rects;
+    glBindFramebuffer(GL_FRAMEBUFFER, scene_cache.fbo);
+    // tiles and blocks are closed and wound outwards; the HUD is drawn both sides
+    glEnable(GL_CULL_FACE);
+    if(scene_cache.valid && dirtyRects(fs, rects))
+    {
+      // redraw just the dirty areas over the persistent image
+      int area=0;
+      glEnable(GL_SCISSOR_TEST);
+      for(size_t r=0;r<rects.size();r++)
       {
+        if(rects[r].area()==0)
+          continue;
+        glScissor(rects[r].x0, rects[r].y0, rects[r].x1-rects[r].x0, rects[r].y1-rects[r].y0);
+        glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // one instanced pass each, the scissor keeps them to the rectangle
+        renderTiles(fs);
+        renderCubes(fs);
+        area+=rects[r].area();
+      }
+      glDisable(GL_SCISSOR_TEST);
+      touched = (float)area/(fb_width*fb_height);
+      render_stats.partial_passes++;
+    }
+    else
+    {
+      glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      renderTiles(fs);
+      renderCubes(fs);
+      touched = 1;
+    }
+    glDisable(GL_CULL_FACE);
+    render_stats.scene_passes++;
+    scene_cache.signature = fs.scene_signature;
+    scene_cache.VP = fs.VP;
+    scene_cache.wave_mode = fs.wave_mode;
+    scene_cache.wave_zs = fs.wave_zs;
+    scene_cache.tiles = fs.tiles;
+    scene_cache.cubes = fs.cubes;
+    scene_cache.valid = true;
+  }
+  if(render_stats.enabled)
+    render_stats.touched.push_back(touched);
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, scene_cache.fbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, fb_width, fb_height, 0, 0, fb_width, fb_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Render the scene with openGL */
+/* Draws a published FrameState - render thread only */
+void render (const FrameState &fs)
+{
+  // use the loaded shader program
+  // Don't change unless you know what you are doing
+  glUseProgram (programID);
+
+  if(fs.hud==HUD_GAME)
+  {
+    renderScene(fs);
+
+    // the HUD is nearer than anything in the scene, no depth test needed on top of the copy
+    glDisable(GL_DEPTH_TEST);
+    draw_boxes(1);
+    draw_scoretext(0);
+    draw_level();
+    draw_score(3,fs);
+    draw_score(0,fs);
+    draw_score(1,fs);
+    draw_score(4,fs);
+    draw_score(5,fs);
+    draw_rect(-85,90+1,90);
+    draw_rect(-85,90+7,90);
+    flushHud();
+    glEnable(GL_DEPTH_TEST);
+    return;
+  }
+
+  // clear the color and depth in the frame buffer
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  if(fs.hud==HUD_GAMEOVER)
+  {
       draw_boxes(2);
       draw_scoretext(1);
-      draw_score(2);
+      draw_score(2,fs);
       draw_gameover();
-	  draw_score(6);
-  	  draw_score(7);
+	  draw_score(6,fs);
+  	  draw_score(7,fs);
   	  draw_rect(5,-30+1,90);
   	  draw_rect(5,-30+7,90);
-
-      }
-      return;
+  	  flushHud();
   }
+}
 
-  draw_boxes(1);
-  draw_scoretext(0);
-  draw_level();
-  draw_score(3);
-  draw_score(0);
-  draw_score(1);
-  draw_score(4);
-  draw_score(5);
-  draw_rect(-85,90+1,90);
-  draw_rect(-85,90+7,90);
+#define SIM_RATE 60     // simulation ticks per second, the animation steps assume 60
 
-  stage.animateStage();
-  block.animateCube();
-  // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-  // glPopMatrix ();
+/* Owns Stage, Block and all game globals. Publishes one FrameState per tick */
+void simulationThread()
+{
+  int prev_fall=0;
+  bool carry_inputs=false;
+  uint64_t published_signature=0;
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+  const std::chrono::microseconds tick(1000000/SIM_RATE);
+
+  while(sim_running.load())
+  {
+        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
+        current_time = glfwGetTime(); // Time in seconds
+        if ((current_time - last_update_time) >= 0.3) { // atleast 0.5s elapsed since last frame
+            last_update_time = current_time;
+            flag_move=1;
+        }
+        if ((current_time - update_call) >= 0.04) { // atleast 0.5s elapsed since last frame
+            update_call = current_time;
+            fall_call =1;
+        }
+        if ((current_time - change_time) >= 1) { // atleast 0.5s elapsed since last frame
+            change_time = current_time;
+            if(flag_gameover==0)
+            	timesec++;
+            if(timesec==60)
+            {
+            	timemin++;
+            	timesec=0;
+            	if(timemin==60)
+            	{
+            		timehr++;
+            		timemin=0;
+            	}
+            }
+        }
+
+    // Simulation tick boundary - apply queued input
+    processInput();
+
+    FrameState &fs = frames.writeBuffer();
+    sim_frame = &fs;
+    fs.tiles.clear();
+    fs.cubes.clear();
+    fs.wave_mode = WAVE_NONE;
+    fs.wave_zs = 0;
+    // inputs of a state the renderer never picked up are carried into this one
+    if(!carry_inputs)
+      fs.inputs.clear();
+    simulate(cursor_x.load(), cursor_y.load());
+    latency.collect(fs.inputs);
+
+    // Only hand over states that look different, so an idle game lets the renderer sleep
+    fs.scene_signature = fs.sceneSignature();
+    uint64_t signature = fs.signature();
+    if(signature!=published_signature || !fs.inputs.empty())
+    {
+      published_signature = signature;
+      carry_inputs = frames.publish();
+      glfwPostEmptyEvent();
+    }
 
-  // Increment angles
+    if(flag_fall==1 && prev_fall==0)
+      audio.play(SOUND_FALL);
+    prev_fall=flag_fall;
 
-  //camera_rotation_angle++; // Simulating camera rotation
+    next += tick;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if(now > next+10*tick)
+      next = now;     // fell far behind, don't try to catch up
+    std::this_thread::sleep_until(next);
+  }
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -2627,17 +4628,32 @@ GLFWwindow* initGLFW (int width, int height)
 {
     GLFWwindow* window; // window desciptor/handle
 
+    double t = startup.now();
     glfwSetErrorCallback(error_callback);
     if (!glfwInit()) {
 //        exit(EXIT_FAILURE);
     }
+    startup.add("glfwInit", t);
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if(headless)
+      glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-    window = glfwCreateWindow(width, height, "Bloxorz", NULL, NULL);
+    // ask for 4.5 core for the fast path, the game itself only needs 3.3
+    t = startup.now();
+    window = NULL;
+    if(fast_path_allowed)
+    {
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+      window = glfwCreateWindow(width, height, "Bloxorz", NULL, NULL);
+    }
+    if (!window) {
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+      window = glfwCreateWindow(width, height, "Bloxorz", NULL, NULL);
+    }
 
     if (!window) {
         glfwTerminate();
@@ -2645,7 +4661,10 @@ GLFWwindow* initGLFW (int width, int height)
     }
 
     glfwMakeContextCurrent(window);
+    startup.add("window", t);
+    t = startup.now();
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+    startup.add("glad load", t);
     glfwSwapInterval( 1 );
 
     /* --- register callbacks with GLFW --- */
@@ -2655,6 +4674,7 @@ GLFWwindow* initGLFW (int width, int height)
      is different from WindowSize */
     glfwSetFramebufferSizeCallback(window, reshapeWindow);
     glfwSetWindowSizeCallback(window, reshapeWindow);
+    glfwSetWindowRefreshCallback(window, refreshWindow);
 
     /* Register function to handle window close */
     glfwSetWindowCloseCallback(window, quit);
@@ -2674,8 +4694,14 @@ GLFWwindow* initGLFW (int width, int height)
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
+  // decides how every GL object below is created, so it comes first
+  fast_path = fast_path_allowed && (GLAD_GL_VERSION_4_5 ||
+              (GLAD_GL_ARB_direct_state_access && GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance));
+  stream.create(256*1024);
+
     /* Objects should be created before any other gl function and shaders */
   // Create the models
+  double t = startup.now();
   block.createSquare();
   stage.createStage2();
   stage.createStage1();
@@ -2683,11 +4709,36 @@ void initGL (GLFWwindow* window, int width, int height)
   stage.createRectangle();
   createRectangle();
   createRectangle2();
+  startup.add("mesh upload", t);
+
   // Create and compile our GLSL program from the shaders
-  programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
+  t = startup.now();
+  programID = LoadShaders( "Sample_GL", Sample_GL_vert, Sample_GL_frag );
   // Get a handle for our "MVP" uniform
   Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
 
+  // Instanced stage tiles
+  tile_shader.program = LoadShaders( "Tile_GL", Tile_GL_vert, Sample_GL_frag );
+  tile_shader.VP = glGetUniformLocation(tile_shader.program, "VP");
+  tile_shader.faces = glGetUniformLocation(tile_shader.program, "faces");
+  tile_shader.wave = glGetUniformLocation(tile_shader.program, "wave");
+  glm::mat4 faces[TILE_FACES];
+  for(int f=0;f<TILE_FACES;f++)
+    faces[f] = tileFaceMatrix(f);
+  glUseProgram(tile_shader.program);
+  glUniformMatrix4fv(tile_shader.faces, TILE_FACES, GL_FALSE, &faces[0][0][0]);
+  slab_shader.program = LoadShaders( "Slab_GL", Slab_GL_vert, Slab_GL_frag );
+  slab_shader.VP = glGetUniformLocation(slab_shader.program, "VP");
+  slab_shader.height = glGetUniformLocation(slab_shader.program, "height");
+
+  // Instanced, rolling block cubes
+  cube_shader.program = LoadShaders( "Cube_GL", Cube_GL_vert, Sample_GL_frag );
+  cube_shader.VP = glGetUniformLocation(cube_shader.program, "VP");
+
+  // HUD quads, MVP per instance
+  hud_batch.program = LoadShaders( "Hud_GL", Hud_GL_vert, Sample_GL_frag );
+  startup.add("shaders", t);
+
   
   reshapeWindow (window, width, height);
 
@@ -2702,6 +4753,7 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
     cout << "VERSION: " << glGetString(GL_VERSION) << endl;
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+    cout << "PATH: " << (fast_path ? "GL 4.5 direct state access, multi-draw-indirect" : "GL 3.3") << endl;
 }
 
 int main (int argc, char** argv)
@@ -2709,57 +4761,142 @@ int main (int argc, char** argv)
   int width = 800;
   int height = 700;
 
-  double x1,y1;
+  const char *audio_backend = "device";
+  double headless_time=0, next_input=0, render_start, render_end;
+  int script=0;
+  static const int script_moves[] = { 2, 3, 1, 4 };
+  bool first_frame = true;
+
+  render_backend = &gl_backend;
+
+  for(int i=1;i<argc;i++)
+  {
+    if(!strcmp(argv[i], "--audio") && i+1<argc)
+      audio_backend = argv[++i];
+    else if(!strcmp(argv[i], "--latency"))
+      latency.enabled = true;
+    else if(!strcmp(argv[i], "--stats"))
+      render_stats.enabled = true;
+    else if(!strcmp(argv[i], "--no-shader-cache"))
+      shader_stats.use_cache = false;
+    else if(!strcmp(argv[i], "--no-fast-path"))
+      fast_path_allowed = false;
+    else if(!strcmp(argv[i], "--capture") && i+1<argc)
+      capture.path = argv[++i];
+    else if(!strcmp(argv[i], "--headless") && i+1<argc)
+    {
+      headless = 1;
+      headless_time = atof(argv[++i]);
+      latency.enabled = true;
+      audio_backend = "null";
+    }
+  }
+
+  // CPU-only startup work runs while the window and context are created
+  std::future<void> levels = std::async(std::launch::async, [] {
+    double t = startup.now();
+    stage.loadLevels();
+    startup.add("level data", t, true);
+  });
+  std::future<void> sound = std::async(std::launch::async, [audio_backend] {
+    double t = startup.now();
+    audio.init(audio_backend);
+    startup.add("audio", t, true);
+  });
 
     GLFWwindow* window = initGLFW(width, height);
 
   initGL (window, width, height);
+  levels.get();
+  sound.get();
+
+  // this thread keeps the GL context and the GLFW event loop
+  sim_running = true;
+  std::thread sim(simulationThread);
 
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
 
         glfwGetCursorPos(window, &xpos, &ypos);
-        x1=(xpos-400)*1.0*3/10;
-        y1=(350-ypos)*1.0/3.5;
+        glm::vec2 hud = hudPoint(cursorNdc(window, xpos, ypos));
+        cursor_x = hud.x;
+        cursor_y = hud.y;
 
-        // OpenGL Draw commands
-        draw(x1,y1);
+        // Pick up the newest simulated state, if any
+        bool fresh = frames.update();
+        const FrameState &fs = frames.readBuffer();
 
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
-
-        // Poll for Keyboard and mouse events
-        glfwPollEvents();
+        if(fresh || force_redraw)
+        {
+          // OpenGL Draw commands
+          render_start = glfwGetTime();
+          stream.beginFrame();
+          render(fs);
+          stream.endFrame();
+          capture.frame();
+          render_end = glfwGetTime();
+
+          // Swap Frame Buffer in double buffering
+          glfwSwapBuffers(window);
+          if(fresh)
+            latency.frame(fs.inputs, render_start, render_end, glfwGetTime());
+          force_redraw=0;
+          render_stats.frames++;
+
+          if(first_frame && fs.valid)
+          {
+            first_frame = false;
+            startup.report();
+            printf("  %d of %d shader programs from cache\n", shader_stats.cached, shader_stats.programs);
+            if(render_stats.enabled)
+              gpu.report("after the first frame");
+          }
 
-        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
-        if ((current_time - last_update_time) >= 0.3) { // atleast 0.5s elapsed since last frame
-            last_update_time = current_time;
-            flag_move=1;
-        }
-        if ((current_time - update_call) >= 0.04) { // atleast 0.5s elapsed since last frame
-            update_call = current_time;
-            fall_call =1;
+          // Poll for Keyboard and mouse events
+          glfwPollEvents();
         }
-        if ((current_time - change_time) >= 1) { // atleast 0.5s elapsed since last frame
-            change_time = current_time;
-            if(flag_gameover==0)
-            	timesec++;
-            if(timesec==60)
-            {
-            	timemin++;
-            	timesec=0;
-            	if(timemin==60)
-            	{
-            		timehr++;
-            		timemin=0;
-            	}
-            }
+        else
+        {
+          // Nothing changed on screen - sleep until input, a new state
+          // from the simulation (it posts an empty event) or the clock tick
+          double timeout = 1.0;
+          if(headless)
+            timeout = max(0.001, min(timeout, next_input-glfwGetTime()));
+          glfwWaitEventsTimeout(timeout);
         }
 
+        if(headless)
+        {
+          // scripted key presses, faster than the block can roll
+          if(glfwGetTime()>=next_input)
+          {
+            pushInput(INPUT_MOVE, script_moves[script++%4], 0, 0);
+            next_input = glfwGetTime()+0.15;
+          }
+          if(glfwGetTime()>=headless_time)
+            glfwSetWindowShouldClose(window, 1);
+        }
     }
 
+    sim_running = false;
+    sim.join();
+    capture.finish();
+
+    latency.report();
+    render_stats.report();
+    if(render_stats.enabled)
+      stream.report();
+    audio.shutdown();
+
+    // same counts as after the first frame, however many restarts, or something leaked
+    if(render_stats.enabled)
+      gpu.report("at exit");
+    destroy3DObject(rect1);
+    destroy3DObject(rect2);
+    rect1 = rect2 = NULL;
+    stream.release();
+    gpu.release();
+    glfwDestroyWindow(window);
     glfwTerminate();
 //    exit(EXIT_SUCCESS);
 }
-  
\ No newline at end of file
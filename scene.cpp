@@ -0,0 +1,698 @@
+/* The GL-free half of the game: meshes through a RenderBackend, the level
+   data, the preview scene and the software rasteriser. Built into ans and,
+   on its own, into the thumbnails tool */
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "scene.h"
+
+#include <glm/gtx/transform.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+RenderBackend *render_backend;    // set by main before any mesh is made
+
+/* Copy a mesh into the current backend and return its handle */
+struct VAO* create3DObject (unsigned int primitive_mode, int numVertices, const float* vertex_buffer_data, const float* color_buffer_data, unsigned int fill_mode)
+{
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+
+    vector<MeshVertex> vertices(numVertices);
+    for (int i=0; i<numVertices; i++) {
+        for (int c=0; c<3; c++) {
+            vertices[i].position[c] = vertex_buffer_data[3*i + c];
+            vertices[i].color[c] = color_buffer_data[3*i + c];
+        }
+    }
+    render_backend->upload(vao, &vertices[0]);
+
+    return vao;
+}
+
+/* Hand a mesh's vertices back to the backend and free the handle */
+void destroy3DObject (struct VAO* vao)
+{
+    if (vao == NULL)
+        return;
+    render_backend->release(vao);
+    delete vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+struct VAO* create3DObject (unsigned int primitive_mode, int numVertices, const float* vertex_buffer_data, const float red, const float green, const float blue, unsigned int fill_mode)
+{
+    float* color_buffer_data = new float [3*numVertices];
+    for (int i=0; i<numVertices; i++) {
+        color_buffer_data [3*i] = red;
+        color_buffer_data [3*i + 1] = green;
+        color_buffer_data [3*i + 2] = blue;
+    }
+
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    delete [] color_buffer_data;
+    return vao;
+}
+
+/* Render the VBOs handled by VAO */
+void draw3DObject (struct VAO* vao, const glm::mat4 &MVP)
+{
+    render_backend->draw(vao, MVP);
+}
+
+/* Runs on a worker thread at the game's startup */
+void Levels::loadLevels()
+{
+  start[0][0]=1;
+  start[0][1]=6;
+  start[1][0]=1;
+  start[1][1]=3;
+  start[2][0]=1;
+  start[2][1]=3;
+  start[3][0]=1;
+  start[3][1]=4;
+
+  for(int l=0;l<5;l++)
+    cubes[l]=2;
+  split[3][0][0]=10;split[3][0][1]=7;
+  split[3][1][0]=10;split[3][1][1]=1;
+
+  for(int i=0;i<15;i++)
+  {
+    for(int j=0;j<10;j++)
+    {
+      stage[0][i][j]=0;
+      stage[1][i][j]=0;
+      stage[2][i][j]=0;
+      stage[3][i][j]=0;
+    }
+  }
+
+  stage[0][1][7]=1;stage[0][1][6]=1;stage[0][1][5]=1;stage[0][1][4]=1;
+  stage[0][2][7]=1;stage[0][2][6]=1;stage[0][2][5]=1;stage[0][2][4]=1;
+  stage[0][3][6]=1;stage[0][3][5]=1;stage[0][3][4]=1;
+  stage[0][4][4]=1;
+  stage[0][5][4]=1;stage[0][5][3]=1;
+  stage[0][6][5]=1;stage[0][6][4]=1;stage[0][6][3]=1;stage[0][6][2]=1;
+  stage[0][7][4]=1;stage[0][7][2]=1;
+  stage[0][8][5]=1;stage[0][8][4]=1;stage[0][8][3]=1;stage[0][8][2]=1;
+  stage[0][9][4]=1;stage[0][9][2]=1;
+
+  target[0][0]=7;target[0][1]=3;
+  stage[0][7][3]=2;
+
+  stage[1][0][2]=1;stage[1][0][3]=1;stage[1][0][4]=1;stage[1][0][5]=1;stage[1][0][6]=1;
+  stage[1][1][2]=1;stage[1][1][3]=1;stage[1][1][4]=1;stage[1][1][5]=1;stage[1][1][6]=1;
+  stage[1][2][2]=1;stage[1][2][3]=1;stage[1][2][4]=1;stage[1][2][5]=3;stage[1][2][6]=1;
+  stage[1][3][2]=1;stage[1][3][3]=1;stage[1][3][4]=1;stage[1][3][5]=1;stage[1][3][6]=1;
+  stage[1][6][2]=1;stage[1][6][3]=1;stage[1][6][4]=1;stage[1][6][5]=1;stage[1][6][6]=1;stage[1][6][7]=1;
+  stage[1][7][2]=1;stage[1][7][3]=1;stage[1][7][4]=1;stage[1][7][5]=1;stage[1][7][6]=1;stage[1][7][7]=1;
+  stage[1][8][2]=1;stage[1][8][3]=1;stage[1][8][4]=1;stage[1][8][5]=1;stage[1][8][6]=4;stage[1][8][7]=1;
+  stage[1][9][2]=1;stage[1][9][3]=1;stage[1][9][4]=1;stage[1][9][5]=1;stage[1][9][6]=1;stage[1][9][7]=1;
+  stage[1][12][3]=1;stage[1][12][4]=1;stage[1][12][5]=1;stage[1][12][6]=1;stage[1][12][7]=1;
+  stage[1][13][3]=1;stage[1][13][4]=1;stage[1][13][5]=1;stage[1][13][6]=2;stage[1][13][7]=1;
+  stage[1][14][3]=1;stage[1][14][4]=1;stage[1][14][5]=1;stage[1][14][6]=1;stage[1][14][7]=1;
+
+  target[1][0]=13;target[1][1]=6;
+
+  stage[2][0][2]=1;stage[2][0][3]=1;stage[2][0][4]=1;stage[2][0][5]=1;stage[2][0][6]=1;
+  stage[2][1][2]=1;stage[2][1][3]=1;stage[2][1][4]=1;stage[2][1][5]=1;stage[2][1][6]=1;
+  stage[2][2][2]=1;stage[2][2][3]=1;stage[2][2][4]=1;stage[2][2][5]=1;stage[2][2][6]=1;
+  stage[2][3][6]=1;stage[2][3][7]=5;stage[2][3][8]=5;
+  stage[2][4][7]=5;stage[2][4][8]=5;
+  stage[2][5][0]=1;stage[2][5][1]=1;stage[2][5][2]=1;stage[2][5][3]=1;stage[2][5][7]=5;stage[2][5][8]=5;
+  stage[2][6][0]=1;stage[2][6][1]=2;stage[2][6][2]=1;stage[2][6][3]=1;stage[2][6][7]=5;stage[2][6][8]=5;
+  stage[2][7][0]=1;stage[2][7][1]=1;stage[2][7][2]=1;stage[2][7][3]=1;stage[2][7][7]=5;stage[2][7][8]=5;
+  stage[2][8][2]=1;stage[2][8][3]=1;stage[2][8][7]=5;stage[2][8][8]=5;
+  stage[2][9][2]=5;stage[2][9][3]=5;stage[2][9][6]=1;stage[2][9][7]=5;stage[2][9][8]=5;
+  stage[2][10][0]=5;stage[2][10][1]=5;stage[2][10][2]=5;stage[2][10][3]=5;stage[2][10][4]=1;stage[2][10][5]=1;stage[2][10][6]=1;
+  stage[2][11][0]=5;stage[2][11][1]=5;stage[2][11][2]=5;stage[2][11][3]=5;stage[2][11][4]=1;stage[2][11][5]=1;stage[2][11][6]=1;
+  stage[2][12][0]=5;stage[2][12][1]=1;stage[2][12][2]=5;stage[2][12][3]=5;
+  stage[2][13][0]=5;stage[2][13][1]=5;stage[2][13][2]=5;stage[2][13][3]=5;
+
+  target[2][0]=6;target[2][1]=1;
+
+  stage[3][0][3]=1;stage[3][0][4]=1;stage[3][0][5]=1;
+  stage[3][1][3]=1;stage[3][1][4]=1;stage[3][1][5]=1;
+  stage[3][2][3]=1;stage[3][2][4]=1;stage[3][2][5]=1;
+  stage[3][3][3]=1;stage[3][3][4]=1;stage[3][3][5]=1;
+  stage[3][4][3]=1;stage[3][4][4]=6;stage[3][4][5]=1;
+  stage[3][5][3]=1;stage[3][5][4]=1;stage[3][5][5]=1;
+  stage[3][9][0]=1;stage[3][9][1]=1;stage[3][9][2]=1;stage[3][9][3]=1;stage[3][9][4]=1;stage[3][9][5]=1;stage[3][9][6]=1;stage[3][9][7]=1;stage[3][9][8]=1;
+  stage[3][10][0]=1;stage[3][10][1]=1;stage[3][10][2]=1;stage[3][10][3]=1;stage[3][10][4]=1;stage[3][10][5]=1;stage[3][10][6]=1;stage[3][10][7]=1;stage[3][10][8]=1;
+  stage[3][11][0]=1;stage[3][11][1]=1;stage[3][11][2]=1;stage[3][11][3]=1;stage[3][11][4]=1;stage[3][11][5]=1;stage[3][11][6]=1;stage[3][11][7]=1;stage[3][11][8]=1;
+  stage[3][12][3]=1;stage[3][12][4]=1;stage[3][12][5]=1;
+  stage[3][13][3]=1;stage[3][13][4]=2;stage[3][13][5]=1;
+  stage[3][14][3]=1;stage[3][14][4]=1;stage[3][14][5]=1;
+
+  target[3][0]=13;target[3][1]=4;
+}
+
+int tileKind(int type)
+{
+  switch(type)
+  {
+    case 3: return TILES_ROUND;
+    case 4: return TILES_CROSS;
+    case 5: return TILES_FRAGILE;
+    case 6: return TILES_TELEPORT;
+    default: return TILES_PLAIN;
+  }
+}
+
+const float tile_faces[TILE_FACES][6] = {
+  // x, y, z, turn in degrees, 1 to turn the mesh over first, 1 for the mesh mirrored in y
+  { 0, 0, 3, 0, 1, 0 },                                             // top
+  { 0, 0, 1, 0, 0, 0 },                                             // bottom
+  { 0, -5, 2, 0, 0, 1 }, { 0, 5, 2, 0, 0, 0 }, { -5, 0, 2, 90, 0, 0 }, { 5, 0, 2, 90, 0, 1 }, // walls
+  { 0, 0, 3.2, 0, 1, 0 }, { 0, 0, 3.2, 90, 1, 0 },                  // switch cross
+  { 0, 0, 3.2, 0, 0, 0 }, { 0, 0, 3.2, 180, 0, 0 },                 // round switch disc
+  { -1, 0, 3.2, 90, 0, 0 }, { 1, 0, 3.2, -90, 0, 0 },               // teleport half discs
+};
+
+glm::mat4 tileFaceMatrix(int f)
+{
+  const float *t = tile_faces[f];
+  glm::mat4 face = glm::translate(glm::vec3(t[0], t[1], t[2])) * glm::rotate((float)(t[3]*M_PI/180.0f), glm::vec3(0,0,1));
+  if(t[4])
+    face = face * glm::rotate((float)M_PI, glm::vec3(1,0,0));
+  return face;
+}
+
+/* Model matrix of a recorded cube - Cube_GL.vert applies the same roll */
+glm::mat4 cubeModel(const CubeDraw &c)
+{
+  glm::vec3 pivot(c.pivot[0], c.pivot[1], c.pivot[2]);
+  return glm::translate(pivot) *
+         glm::rotate((float)(c.angle*M_PI/180.0f), glm::vec3(c.axis[0], c.axis[1], c.axis[2])) *
+         glm::translate(glm::vec3(c.x, c.y, c.z) - pivot);
+}
+
+void SceneMeshes::create()
+{
+  top[0] = createStaticMesh(tile_top);
+  top[1] = createStaticMesh(tile_top_fragile);
+  wall[0][0] = createStaticMesh(tile_wall);
+  wall[1][0] = createStaticMesh(tile_wall_fragile);
+  wall[0][1] = createStaticMesh(tile_wall_mirrored);
+  wall[1][1] = createStaticMesh(tile_wall_mirrored_fragile);
+  cross = createStaticMesh(tile_cross);
+  disc = createStaticMesh(half_disc_180);
+  cube = createStaticMesh(cube_mesh);
+}
+
+void SceneMeshes::destroy()
+{
+  destroy3DObject(cube);
+  destroy3DObject(disc);
+  destroy3DObject(cross);
+  for(int m=1;m>=0;m--)
+    for(int b=1;b>=0;b--)
+      destroy3DObject(wall[b][m]);
+  destroy3DObject(top[1]);
+  destroy3DObject(top[0]);
+}
+
+/* What the game records for the first frame of a level once the stage has
+   risen: every tile of the layout at height 0, and the block's cubes
+   standing one on another on the start cell */
+void previewScene(const Levels &levels, int level, Scene &scene)
+{
+  const int l = level-1;
+  scene.tiles.clear();
+  scene.cubes.clear();
+  for(int i=0;i<15;i++)
+    for(int j=0;j<10;j++)
+    {
+      int type = levels.stage[l][i][j];
+      if(type==1 || type==3 || type==4 || type==5 || type==6)
+      {
+        TileDraw tile = { 5.0f+(i-8)*10, 5.0f+(j-5)*10, 0, type, (float)i, (float)j, 0 };
+        scene.tiles.push_back(tile);
+      }
+    }
+  for(int p=0;p<levels.cubes[l];p++)
+  {
+    CubeDraw cube = { 5.0f+(levels.start[l][0]-8)*10, 5.0f+(levels.start[l][1]-5)*10, (float)p*10, { 0, 0, 1 }, 0, { 0, 0, 0 } };
+    scene.cubes.push_back(cube);
+  }
+  scene.VP = glm::ortho(-120.0f+26, 120.0f-26, -100.0f+26, 100.0f-26, 0.1f, 120.0f) *
+             glm::lookAt(glm::vec3(-22,-43,29), glm::vec3(-10,0,0), glm::vec3(0,0,1));    // preview view, zoom 26
+}
+
+/* The scene one mesh at a time through draw3DObject, the way the GL path
+   placed them before tiles and cubes were instanced */
+void drawScene(const SceneMeshes &meshes, const Scene &scene)
+{
+  static glm::mat4 faces[TILE_FACES];
+  static bool have_faces = false;
+  if(!have_faces)
+  {
+    for(int f=0;f<TILE_FACES;f++)
+      faces[f] = tileFaceMatrix(f);
+    have_faces = true;
+  }
+
+  for(size_t i=0;i<scene.tiles.size();i++)
+  {
+    const TileDraw &t = scene.tiles[i];
+    int kind = tileKind(t.type);
+    bool fragile = kind==TILES_FRAGILE;
+    glm::mat4 M = scene.VP*glm::translate(glm::vec3(t.x, t.y, t.z));
+    draw3DObject(meshes.top[fragile], M*faces[FACE_TOP]);
+    draw3DObject(meshes.top[fragile], M*faces[FACE_BOTTOM]);
+    for(int d=0;d<4;d++)
+      draw3DObject(meshes.wall[fragile][tile_faces[FACE_WALL+d][5]!=0], M*faces[FACE_WALL+d]);
+    for(int h=0;h<2;h++)
+    {
+      if(kind==TILES_CROSS)
+        draw3DObject(meshes.cross, M*faces[FACE_CROSS+h]);
+      else if(kind==TILES_ROUND)
+        draw3DObject(meshes.disc, M*faces[FACE_DISC+h]);
+      else if(kind==TILES_TELEPORT)
+        draw3DObject(meshes.disc, M*faces[FACE_TELEPORT+h]);
+    }
+  }
+  for(size_t i=0;i<scene.cubes.size();i++)
+    draw3DObject(meshes.cube, scene.VP*cubeModel(scene.cubes[i]));
+}
+
+int sceneTriangles(const SceneMeshes &meshes, const Scene &scene)
+{
+  int triangles = 0;
+  for(size_t i=0;i<scene.tiles.size();i++)
+  {
+    int kind = tileKind(scene.tiles[i].type);
+    triangles += 2*meshes.top[kind==TILES_FRAGILE]->NumVertices/3 + 4*meshes.wall[0][0]->NumVertices/3;
+    if(kind==TILES_CROSS)
+      triangles += 2*meshes.cross->NumVertices/3;
+    else if(kind==TILES_ROUND || kind==TILES_TELEPORT)
+      triangles += 2*meshes.disc->NumVertices/3;
+  }
+  return triangles + scene.cubes.size()*meshes.cube->NumVertices/3;
+}
+
+/* SOFT_LANES pixels of a row at a time with SSE2, or AVX2 when built with -mavx2 */
+#if defined(__AVX2__)
+#define SOFT_LANES 8
+typedef __m256 SoftVec;
+typedef __m256i SoftColor;    // packed RGBA8 pixels
+static inline SoftVec softSet(float v) { return _mm256_set1_ps(v); }
+static inline SoftVec softRamp() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+static inline SoftVec softAdd(SoftVec a, SoftVec b) { return _mm256_add_ps(a, b); }
+static inline SoftVec softMul(SoftVec a, SoftVec b) { return _mm256_mul_ps(a, b); }
+static inline SoftVec softDiv(SoftVec a, SoftVec b) { return _mm256_div_ps(a, b); }
+static inline SoftVec softGe(SoftVec a, SoftVec b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline SoftVec softLe(SoftVec a, SoftVec b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline SoftVec softAnd(SoftVec a, SoftVec b) { return _mm256_and_ps(a, b); }
+static inline bool softAny(SoftVec m) { return _mm256_movemask_ps(m)!=0; }
+static inline SoftVec softSelect(SoftVec m, SoftVec a, SoftVec b) { return _mm256_blendv_ps(b, a, m); }
+static inline SoftVec softLoad(const float *p) { return _mm256_loadu_ps(p); }
+static inline void softStore(float *p, SoftVec v) { _mm256_storeu_ps(p, v); }
+static inline SoftColor softLoadColor(const uint32_t *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void softStoreColor(uint32_t *p, SoftColor c) { _mm256_storeu_si256((__m256i *)p, c); }
+static inline SoftColor softSelectColor(SoftVec m, SoftColor a, SoftColor b)
+{
+  return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m));
+}
+static inline SoftColor softPack(SoftVec r, SoftVec g, SoftVec b)
+{
+  const __m256 scale = _mm256_set1_ps(255), half = _mm256_set1_ps(0.5f);
+  __m256i ri = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(r, scale), half));
+  __m256i gi = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(g, scale), half));
+  __m256i bi = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(b, scale), half));
+  return _mm256_or_si256(ri, _mm256_or_si256(_mm256_slli_epi32(gi, 8), _mm256_slli_epi32(bi, 16)));
+}
+#elif defined(__SSE2__)
+#define SOFT_LANES 4
+typedef __m128 SoftVec;
+typedef __m128i SoftColor;
+static inline SoftVec softSet(float v) { return _mm_set1_ps(v); }
+static inline SoftVec softRamp() { return _mm_setr_ps(0, 1, 2, 3); }
+static inline SoftVec softAdd(SoftVec a, SoftVec b) { return _mm_add_ps(a, b); }
+static inline SoftVec softMul(SoftVec a, SoftVec b) { return _mm_mul_ps(a, b); }
+static inline SoftVec softDiv(SoftVec a, SoftVec b) { return _mm_div_ps(a, b); }
+static inline SoftVec softGe(SoftVec a, SoftVec b) { return _mm_cmpge_ps(a, b); }
+static inline SoftVec softLe(SoftVec a, SoftVec b) { return _mm_cmple_ps(a, b); }
+static inline SoftVec softAnd(SoftVec a, SoftVec b) { return _mm_and_ps(a, b); }
+static inline bool softAny(SoftVec m) { return _mm_movemask_ps(m)!=0; }
+static inline SoftVec softSelect(SoftVec m, SoftVec a, SoftVec b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+static inline SoftVec softLoad(const float *p) { return _mm_loadu_ps(p); }
+static inline void softStore(float *p, SoftVec v) { _mm_storeu_ps(p, v); }
+static inline SoftColor softLoadColor(const uint32_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void softStoreColor(uint32_t *p, SoftColor c) { _mm_storeu_si128((__m128i *)p, c); }
+static inline SoftColor softSelectColor(SoftVec m, SoftColor a, SoftColor b)
+{
+  __m128i mi = _mm_castps_si128(m);
+  return _mm_or_si128(_mm_and_si128(mi, a), _mm_andnot_si128(mi, b));
+}
+static inline SoftColor softPack(SoftVec r, SoftVec g, SoftVec b)
+{
+  const __m128 scale = _mm_set1_ps(255), half = _mm_set1_ps(0.5f);
+  __m128i ri = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, scale), half));
+  __m128i gi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, scale), half));
+  __m128i bi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half));
+  return _mm_or_si128(ri, _mm_or_si128(_mm_slli_epi32(gi, 8), _mm_slli_epi32(bi, 16)));
+}
+#else
+// one pixel at a time, masks are 0 or 1
+#define SOFT_LANES 1
+typedef float SoftVec;
+typedef uint32_t SoftColor;
+static inline SoftVec softSet(float v) { return v; }
+static inline SoftVec softRamp() { return 0; }
+static inline SoftVec softAdd(SoftVec a, SoftVec b) { return a+b; }
+static inline SoftVec softMul(SoftVec a, SoftVec b) { return a*b; }
+static inline SoftVec softDiv(SoftVec a, SoftVec b) { return a/b; }
+static inline SoftVec softGe(SoftVec a, SoftVec b) { return a>=b; }
+static inline SoftVec softLe(SoftVec a, SoftVec b) { return a<=b; }
+static inline SoftVec softAnd(SoftVec a, SoftVec b) { return a*b; }
+static inline bool softAny(SoftVec m) { return m!=0; }
+static inline SoftVec softSelect(SoftVec m, SoftVec a, SoftVec b) { return m!=0 ? a : b; }
+static inline SoftVec softLoad(const float *p) { return *p; }
+static inline void softStore(float *p, SoftVec v) { *p = v; }
+static inline SoftColor softLoadColor(const uint32_t *p) { return *p; }
+static inline void softStoreColor(uint32_t *p, SoftColor c) { *p = c; }
+static inline SoftColor softSelectColor(SoftVec m, SoftColor a, SoftColor b) { return m!=0 ? a : b; }
+static inline SoftColor softPack(SoftVec r, SoftVec g, SoftVec b)
+{
+  return (uint32_t)(r*255+0.5f) | (uint32_t)(g*255+0.5f)<<8 | (uint32_t)(b*255+0.5f)<<16;
+}
+#endif
+
+SoftBackend::SoftBackend(int threads) : width(0), height(0), stride(0), tiles_x(0), tiles_y(0), next_tile(0),
+                                        picture(0), busy(0), quit(false)
+{
+  if(threads<=0)
+    threads = max(1u, std::thread::hardware_concurrency());
+  for(int w=1;w<threads;w++)
+    workers.push_back(std::thread(&SoftBackend::work, this));
+}
+
+SoftBackend::~SoftBackend()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_all();
+  for(size_t w=0;w<workers.size();w++)
+    workers[w].join();
+}
+
+int SoftBackend::lanes()
+{
+  return SOFT_LANES;
+}
+
+/* Window coordinates, the bounds and the edge functions of a clipped
+   triangle. Back facing or empty ones are dropped */
+void SoftBackend::setup(const SoftVertex &v0, const SoftVertex &v1, const SoftVertex &v2)
+{
+  const SoftVertex *v[3] = { &v0, &v1, &v2 };
+  SoftTriangle t;
+  float x[3], y[3];
+  for(int k=0;k<3;k++)
+  {
+    float q = 1/v[k]->clip.w;
+    x[k] = (v[k]->clip.x*q*0.5f+0.5f)*width;
+    y[k] = (v[k]->clip.y*q*0.5f+0.5f)*height;
+    t.z[k] = v[k]->clip.z*q*0.5f+0.5f;
+    t.q[k] = q;
+    for(int c=0;c<3;c++)
+      t.cq[k][c] = v[k]->color[c]*q;
+  }
+  float area = (x[1]-x[0])*(y[2]-y[0]) - (y[1]-y[0])*(x[2]-x[0]);
+  if(!(area>0))     // counter-clockwise is the front, as in GL
+    return;
+
+  t.x0 = max(0, (int)floor(min(x[0], min(x[1], x[2]))));
+  t.y0 = max(0, (int)floor(min(y[0], min(y[1], y[2]))));
+  t.x1 = min(width-1, (int)ceil(max(x[0], max(x[1], x[2]))));
+  t.y1 = min(height-1, (int)ceil(max(y[0], max(y[1], y[2]))));
+  if(t.x0>t.x1 || t.y0>t.y1)
+    return;
+
+  // the weight of vertex k comes from the edge opposite it
+  for(int k=0;k<3;k++)
+  {
+    int i=(k+1)%3, j=(k+2)%3;
+    t.a[k] = -(y[j]-y[i])/area;
+    t.b[k] = (x[j]-x[i])/area;
+    t.c[k] = -(t.a[k]*x[i] + t.b[k]*y[i]);
+  }
+
+  int n = triangles.size();
+  triangles.push_back(t);
+  for(int ty=t.y0/SOFT_TILE;ty<=t.y1/SOFT_TILE;ty++)
+    for(int tx=t.x0/SOFT_TILE;tx<=t.x1/SOFT_TILE;tx++)
+      bins[ty*tiles_x+tx].push_back(n);
+}
+
+/* Every triangle binned to one tile, in order. Only this thread touches the tile's pixels */
+void SoftBackend::rasterTile(int tile)
+{
+  int tx0 = tile%tiles_x*SOFT_TILE, ty0 = tile/tiles_x*SOFT_TILE;
+  int tx1 = tx0+SOFT_TILE-1, ty1 = min(ty0+SOFT_TILE, height)-1;
+  const SoftVec zero = softSet(0), ramp = softRamp();
+  const vector<int> &bin = bins[tile];
+  for(size_t n=0;n<bin.size();n++)
+  {
+    const SoftTriangle &t = triangles[bin[n]];
+    // whole lanes from the tile's edge, pixels past the triangle fail the edge test
+    int x0 = tx0+(max(t.x0, tx0)-tx0)/SOFT_LANES*SOFT_LANES, x1 = min(t.x1, tx1);
+    int y0 = max(t.y0, ty0), y1 = min(t.y1, ty1);
+    SoftVec a[3], step[3], z[3], q[3], cq[3][3];
+    for(int k=0;k<3;k++)
+    {
+      a[k] = softSet(t.a[k]);
+      step[k] = softSet(t.a[k]*SOFT_LANES);
+      z[k] = softSet(t.z[k]);
+      q[k] = softSet(t.q[k]);
+      for(int c=0;c<3;c++)
+        cq[k][c] = softSet(t.cq[k][c]);
+    }
+    for(int y=y0;y<=y1;y++)
+    {
+      float px = x0+0.5f, py = y+0.5f;
+      SoftVec e[3];
+      for(int k=0;k<3;k++)
+        e[k] = softAdd(softSet(t.a[k]*px + t.b[k]*py + t.c[k]), softMul(a[k], ramp));
+      float *zrow = &depth[(long)y*stride];
+      uint32_t *crow = &color[(long)y*stride];
+      for(int x=x0;x<=x1;x+=SOFT_LANES)
+      {
+        SoftVec in = softAnd(softAnd(softGe(e[0], zero), softGe(e[1], zero)), softGe(e[2], zero));
+        if(softAny(in))
+        {
+          SoftVec d = softAdd(softAdd(softMul(e[0], z[0]), softMul(e[1], z[1])), softMul(e[2], z[2]));
+          SoftVec old = softLoad(zrow+x);
+          SoftVec pass = softAnd(in, softLe(d, old));
+          if(softAny(pass))
+          {
+            softStore(zrow+x, softSelect(pass, d, old));
+            SoftVec w = softDiv(softSet(1), softAdd(softAdd(softMul(e[0], q[0]), softMul(e[1], q[1])), softMul(e[2], q[2])));
+            SoftVec rgb[3];
+            for(int c=0;c<3;c++)
+              rgb[c] = softMul(w, softAdd(softAdd(softMul(e[0], cq[0][c]), softMul(e[1], cq[1][c])), softMul(e[2], cq[2][c])));
+            softStoreColor(crow+x, softSelectColor(pass, softPack(rgb[0], rgb[1], rgb[2]), softLoadColor(crow+x)));
+          }
+        }
+        for(int k=0;k<3;k++)
+          e[k] = softAdd(e[k], step[k]);
+      }
+    }
+  }
+}
+
+void SoftBackend::rasterTiles()
+{
+  int tile;
+  while((tile = next_tile++) < tiles_x*tiles_y)
+    rasterTile(tile);
+}
+
+/* A pool thread: one pass over the tiles for every picture finish() starts */
+void SoftBackend::work()
+{
+  long seen = 0;
+  std::unique_lock<std::mutex> guard(lock);
+  for(;;)
+  {
+    wake.wait(guard, [&] { return quit || picture!=seen; });
+    if(quit)
+      return;
+    seen = picture;
+    guard.unlock();
+    rasterTiles();
+    guard.lock();
+    if(--busy==0)
+      done.notify_one();
+  }
+}
+
+void SoftBackend::upload(VAO *vao, const MeshVertex *vertices)
+{
+  vao->First = meshes.size();
+  vao->VertexArrayID = 0;
+  meshes.insert(meshes.end(), vertices, vertices+vao->NumVertices);
+}
+
+/* Meshes are only created at startup, so space is given back only from the end */
+void SoftBackend::release(VAO *vao)
+{
+  if(vao->First+vao->NumVertices==(int)meshes.size())
+    meshes.resize(vao->First);
+}
+
+/* Start a picture, cleared to the colour and depth initGL sets for GL */
+void SoftBackend::begin(int w, int h)
+{
+  width = w;
+  height = h;
+  tiles_x = (w+SOFT_TILE-1)/SOFT_TILE;
+  tiles_y = (h+SOFT_TILE-1)/SOFT_TILE;
+  stride = tiles_x*SOFT_TILE;
+  uint32_t clear = 255 | 250<<8 | 250<<16;
+  color.assign((long)stride*h, clear);
+  depth.assign((long)stride*h, 1.0f);
+  triangles.clear();
+  bins.resize(tiles_x*tiles_y);
+  for(size_t b=0;b<bins.size();b++)
+    bins[b].clear();
+}
+
+void SoftBackend::draw(VAO *vao, const glm::mat4 &MVP)
+{
+  for(int v=vao->First;v+2<vao->First+vao->NumVertices;v+=3)
+  {
+    SoftVertex in[3];
+    for(int k=0;k<3;k++)
+    {
+      const MeshVertex &m = meshes[v+k];
+      in[k].clip = MVP*glm::vec4(m.position[0], m.position[1], m.position[2], 1);
+      in[k].color = glm::vec3(m.color[0], m.color[1], m.color[2]);
+    }
+
+    // wholly outside one side of the view volume
+    bool outside = false;
+    for(int axis=0;axis<3 && !outside;axis++)
+      outside = (in[0].clip[axis]>in[0].clip.w && in[1].clip[axis]>in[1].clip.w && in[2].clip[axis]>in[2].clip.w) ||
+                (in[0].clip[axis]<-in[0].clip.w && in[1].clip[axis]<-in[1].clip.w && in[2].clip[axis]<-in[2].clip.w);
+    if(outside)
+      continue;
+
+    // clip to the near plane, z >= -w, a triangle becomes up to a quad
+    SoftVertex out[4];
+    int n = 0;
+    for(int k=0;k<3;k++)
+    {
+      const SoftVertex &p = in[k], &r = in[(k+1)%3];
+      float dp = p.clip.z+p.clip.w, dr = r.clip.z+r.clip.w;
+      if(dp>=0)
+        out[n++] = p;
+      if((dp>=0)!=(dr>=0))
+      {
+        float s = dp/(dp-dr);
+        out[n].clip = p.clip+(r.clip-p.clip)*s;
+        out[n].color = p.color+(r.color-p.color)*s;
+        n++;
+      }
+    }
+    for(int k=1;k+1<n;k++)
+      setup(out[0], out[k], out[k+1]);
+  }
+}
+
+/* Rasterise everything drawn since begin(), on this thread and the pool */
+void SoftBackend::finish()
+{
+  next_tile = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    picture++;
+    busy = workers.size();
+  }
+  wake.notify_all();
+  rasterTiles();
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&] { return busy==0; });
+}
+
+/* The picture as RGB, bottom row first */
+void SoftBackend::read(vector<unsigned char> &rgb)
+{
+  rgb.resize((long)width*height*3);
+  for(int y=0;y<height;y++)
+    for(int x=0;x<width;x++)
+    {
+      uint32_t p = color[(long)y*stride+x];
+      unsigned char *out = &rgb[((long)y*width+x)*3];
+      out[0] = p&255;
+      out[1] = p>>8&255;
+      out[2] = p>>16&255;
+    }
+}
+
+bool writeThumbnail(const string &name, int width, int height, const vector<unsigned char> &rgb)
+{
+  FILE *out = fopen(name.c_str(), "wb");
+  if(!out)
+  {
+    fprintf(stderr, "Thumbnails: cannot write %s\n", name.c_str());
+    return false;
+  }
+  fprintf(out, "P6\n%d %d\n255\n", width, height);
+  for(int y=height-1;y>=0;y--)
+    fwrite(&rgb[(long)y*width*3], 1, width*3, out);
+  fclose(out);
+  return true;
+}
+
+static double nowMs()
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void renderThumbnails(PictureBackend &backend, const string &dir, int width, int height)
+{
+  render_backend = &backend;
+  Levels levels;
+  levels.loadLevels();
+  SceneMeshes meshes;
+  meshes.create();
+
+  printf("Thumbnails, %dx%d, best and mean of %d runs (%s):\n", width, height, THUMBNAIL_RUNS, backend.name());
+  for(int level=1;level<=LEVELS;level++)
+  {
+    Scene scene;
+    previewScene(levels, level, scene);
+    double best = 1e9, total = 0;
+    for(int run=0;run<THUMBNAIL_RUNS;run++)
+    {
+      double t = nowMs();
+      backend.begin(width, height);
+      drawScene(meshes, scene);
+      backend.finish();
+      t = nowMs()-t;
+      best = min(best, t);
+      total += t;
+    }
+
+    vector<unsigned char> rgb;
+    backend.read(rgb);
+    char name[32];
+    snprintf(name, sizeof(name), "/level-%d.ppm", level);
+    writeThumbnail(dir+name, width, height, rgb);
+    printf("  level %d: %6d triangles  %8.3f ms  %8.3f ms\n", level, sceneTriangles(meshes, scene), best, total/THUMBNAIL_RUNS);
+  }
+  meshes.destroy();
+}
@@ -0,0 +1,372 @@
+/* What the game and the GL-free thumbnail tool share: mesh handles and the
+   backend interface they are drawn through, the built-in meshes, the level
+   data, tile and cube placement, and the software rasteriser. Nothing in
+   here or in scene.cpp includes a GL header */
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+using namespace std;
+
+/* The GL_TRIANGLES and GL_FILL values, for meshes made without the GL headers */
+#define MESH_TRIANGLES 0x0004
+#define MESH_FILL 0x1B02
+
+struct VAO {
+    unsigned int VertexArrayID;   // the shared mesh vertex array, see GpuResources
+    int First;                    // first vertex of this mesh in it
+
+    unsigned int PrimitiveMode;
+    unsigned int FillMode;
+    int NumVertices;
+};
+typedef struct VAO VAO;
+
+/* Vertex layout of the shared mesh buffer */
+struct MeshVertex {
+  float position[3];
+  float color[3];
+};
+
+/* Where meshes live and how draw3DObject draws one. The game draws through
+   GL; the thumbnail tool through SoftBackend, which needs no GL */
+class RenderBackend {
+public:
+  virtual ~RenderBackend() {}
+  virtual void upload(VAO *vao, const MeshVertex *vertices) = 0;  // sets First and VertexArrayID
+  virtual void release(VAO *vao) = 0;
+  virtual void draw(VAO *vao, const glm::mat4 &MVP) = 0;
+};
+
+/* A backend that also draws whole pictures and reads them back, what
+   renderThumbnails() needs */
+class PictureBackend : public RenderBackend {
+public:
+  virtual const char *name() = 0;
+  virtual void begin(int width, int height) = 0;    // cleared to the game's background
+  virtual void finish() = 0;                        // returns once the picture is done
+  virtual void read(vector<unsigned char> &rgb) = 0;  // RGB, bottom row first
+};
+
+extern RenderBackend *render_backend;
+
+struct VAO* create3DObject (unsigned int primitive_mode, int numVertices, const float* vertex_buffer_data, const float* color_buffer_data, unsigned int fill_mode=MESH_FILL);
+struct VAO* create3DObject (unsigned int primitive_mode, int numVertices, const float* vertex_buffer_data, const float red, const float green, const float blue, unsigned int fill_mode=MESH_FILL);
+void destroy3DObject (struct VAO* vao);
+void draw3DObject (struct VAO* vao, const glm::mat4 &MVP);
+
+/* Compile-time geometry: the built-in meshes are constexpr arrays baked into
+   the binary, so startup does no trigonometry */
+constexpr double ct_pi = 3.14159265358979323846;
+
+/* Taylor series, good to ~1e-13 after the range reduction */
+constexpr double ctSin(double x)
+{
+  while(x>ct_pi)
+    x-=2*ct_pi;
+  while(x<-ct_pi)
+    x+=2*ct_pi;
+  double term=x, sum=x;
+  for(int n=1;n<13;n++)
+  {
+    term *= -x*x/((2*n)*(2*n+1));
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr double ctCos(double x)
+{
+  return ctSin(x+ct_pi/2);
+}
+
+template <int Vertices>
+struct StaticMesh {
+  float vertices[Vertices*3];
+  float colors[Vertices*3];
+};
+
+/* Black half disc of radius 4.5 in Segments triangles - the switch and teleport markings */
+template <int Segments>
+constexpr StaticMesh<Segments*3> makeHalfDisc()
+{
+  StaticMesh<Segments*3> mesh = {};
+  for(int i=0;i<Segments;i++)
+  {
+    mesh.vertices[9*i+3] = 4.5*ctCos(i*ct_pi/Segments);
+    mesh.vertices[9*i+4] = 4.5*ctSin(i*ct_pi/Segments);
+    mesh.vertices[9*i+6] = 4.5*ctCos((i+1)*ct_pi/Segments);
+    mesh.vertices[9*i+7] = 4.5*ctSin((i+1)*ct_pi/Segments);
+  }
+  return mesh;
+}
+
+#define CIRCLE_LODS 4
+constexpr int circle_segments[CIRCLE_LODS] = { 16, 32, 64, 180 };
+constexpr StaticMesh<16*3> half_disc_16 = makeHalfDisc<16>();
+constexpr StaticMesh<32*3> half_disc_32 = makeHalfDisc<32>();
+constexpr StaticMesh<64*3> half_disc_64 = makeHalfDisc<64>();
+constexpr StaticMesh<180*3> half_disc_180 = makeHalfDisc<180>();
+
+/* One block cube: six faces, each a square fanned from its centre */
+constexpr StaticMesh<6*12> makeCube()
+{
+  // GL3 accepts only Triangles. Quads are not supported
+  const float square[] = {
+    -5,-5,0,  -5,5,0,  0,0,0,
+    -5,5,0,   5,5,0,   0,0,0,
+    5,5,0,    5,-5,0,  0,0,0,
+    5,-5,0,   -5,-5,0, 0,0,0,
+  };
+  const float edge[3] = { 102.0/255, 0.0/255, 0.0/255 }, centre[3] = { 178.0/255, 34.0/255, 34.0/255 };
+
+  // offset, a 90 degree turn about x (1), y (2) or none (0), as the old per-face matrices did,
+  // and whether to reverse the winding so the front of the face points out of the cube
+  const int faces[6][5] = {
+    { 0, 0, 13, 0, 1 },
+    { 0, 0, 3, 0, 0 },
+    { 0, -5, 8, 1, 1 },
+    { 0, 5, 8, 1, 0 },
+    { -5, 0, 8, 2, 0 },
+    { 5, 0, 8, 2, 1 },
+  };
+
+  StaticMesh<6*12> mesh = {};
+  for(int f=0;f<6;f++)
+    for(int v=0;v<12;v++)
+    {
+      int from = faces[f][4] && v%3<2 ? v-v%3+1-v%3 : v;   // swap the two rim corners
+      float x=square[3*from], y=square[3*from+1], z=square[3*from+2];
+      float *out = mesh.vertices+(f*12+v)*3;
+      if(faces[f][3]==1)        // rotate 90 about x: (x, y, z) -> (x, -z, y)
+      {
+        float t=y; y=-z; z=t;
+      }
+      else if(faces[f][3]==2)   // rotate 90 about y: (x, y, z) -> (z, y, -x)
+      {
+        float t=x; x=z; z=-t;
+      }
+      out[0] = x+faces[f][0];
+      out[1] = y+faces[f][1];
+      out[2] = z+faces[f][2];
+      for(int c=0;c<3;c++)
+        mesh.colors[(f*12+v)*3+c] = v%3==2 ? centre[c] : edge[c];
+    }
+  return mesh;
+}
+
+constexpr StaticMesh<6*12> cube_mesh = makeCube();
+
+/* Tile face colours: plain, then fragile */
+constexpr float tile_edge[2][3] = { { 0.6, 0.6, 0.6 }, { 0.8, 0.30, 0.11 } };
+constexpr float tile_centre[2][3] = { { 0.8, 0.8, 0.8 }, { 1, 0.50, 0.31 } };
+
+/* Tile top or bottom: a 10x10 square in the z=0 plane fanned from its centre */
+constexpr StaticMesh<12> makeTileTop(int body)
+{
+  const float square[] = {
+    -5,-5,0,  -5,5,0,  0,0,0,
+    -5,5,0,   5,5,0,   0,0,0,
+    5,5,0,    5,-5,0,  0,0,0,
+    5,-5,0,   -5,-5,0, 0,0,0,
+  };
+  StaticMesh<12> mesh = {};
+  for(int v=0;v<12;v++)
+    for(int c=0;c<3;c++)
+    {
+      mesh.vertices[3*v+c] = square[3*v+c];
+      mesh.colors[3*v+c] = v%3==2 ? tile_centre[body][c] : tile_edge[body][c];
+    }
+  return mesh;
+}
+
+/* Tile wall: the lower half of a 10x2 fan in the y=0 plane, winding towards +y.
+   Mirrored in y it winds the other way, so the two edge vertices of each
+   triangle swap and the centre (and so every colour) stays where it is */
+constexpr StaticMesh<6> makeTileWall(int body, bool mirrored)
+{
+  const float side[] = {
+    -5,0,-1,  -5,0,1,  0,0,0,
+    -5,0,1,   5,0,1,   0,0,0,
+  };
+  StaticMesh<6> mesh = {};
+  for(int v=0;v<6;v++)
+  {
+    int from = mirrored && v%3<2 ? v-v%3+1-v%3 : v;
+    mesh.vertices[3*v] = side[3*from];
+    mesh.vertices[3*v+1] = mirrored ? -side[3*from+1] : side[3*from+1];
+    mesh.vertices[3*v+2] = side[3*from+2];
+    for(int c=0;c<3;c++)
+      mesh.colors[3*v+c] = v%3==2 ? tile_centre[body][c] : tile_edge[body][c];
+  }
+  return mesh;
+}
+
+constexpr StaticMesh<12> tile_top = makeTileTop(0);
+constexpr StaticMesh<12> tile_top_fragile = makeTileTop(1);
+constexpr StaticMesh<6> tile_wall = makeTileWall(0, false);
+constexpr StaticMesh<6> tile_wall_fragile = makeTileWall(1, false);
+constexpr StaticMesh<6> tile_wall_mirrored = makeTileWall(0, true);   // for the -y and +x walls
+constexpr StaticMesh<6> tile_wall_mirrored_fragile = makeTileWall(1, true);
+
+/* Black diagonal bar of the cross switch */
+constexpr StaticMesh<6> tile_cross = {
+  { -4.5+1,-4.5-1,0,  -4.5-1,-4.5+1,0,  4.5-1,4.5+1,0,
+    4.5-1,4.5+1,0,    4.5+1,4.5-1,0,    -4.5+1,-4.5-1,0 },
+  {}
+};
+
+template <int Vertices>
+struct VAO* createStaticMesh (const StaticMesh<Vertices> &mesh)
+{
+    return create3DObject(MESH_TRIANGLES, Vertices, mesh.vertices, mesh.colors, MESH_FILL);
+}
+
+/* Level layouts, starts and targets. A cell of stage is 0 for a hole, 1 a
+   tile, 2 the target, 3 a round switch, 4 a cross switch, 5 fragile and 6 a
+   teleport */
+#define LEVELS 4
+#define BLOCK_PIECES 8        // most cubes a level's block can have
+
+struct Levels {
+  int stage[5][15][10],target[5][2],start[5][2];
+  int cubes[5];                     // in the block, standing one on another at the start
+  int split[5][BLOCK_PIECES][2];    // where a teleport (6) puts each cube
+
+  void loadLevels();
+};
+
+/* Also the per-instance vertex data of Tile_GL.vert, keep x..z and i..wave packed */
+struct TileDraw {
+  float x,y,z;
+  int type;
+  float i,j;          // grid cell
+  float wave;         // 1 if the height comes from the stage wave, 0 to use z
+};
+
+/* Also the per-instance vertex data of Cube_GL.vert */
+struct CubeDraw {
+  float x,y,z;        // resting position
+  float axis[3];      // roll: rotation by angle degrees about axis through pivot
+  float angle;
+  float pivot[3];
+};
+
+enum { TILES_PLAIN, TILES_ROUND, TILES_CROSS, TILES_TELEPORT, TILES_FRAGILE, TILE_KINDS };
+
+int tileKind(int type);
+
+/* Where each face mesh sits inside a tile, the faces[] uniform of Tile_GL.vert.
+   The face meshes wind counter-clockwise towards +y (walls) and -z (tops), so
+   the turns and mirrors leave every front face pointing out of the tile. The
+   -y and +x walls take the mirrored mesh rather than a half turn, which keeps
+   the visible triangles where the unculled walls had them */
+enum { FACE_TOP, FACE_BOTTOM, FACE_WALL, FACE_CROSS=FACE_WALL+4, FACE_DISC=FACE_CROSS+2,
+       FACE_TELEPORT=FACE_DISC+2, TILE_FACES=FACE_TELEPORT+2 };
+
+extern const float tile_faces[TILE_FACES][6];
+
+glm::mat4 tileFaceMatrix(int f);
+glm::mat4 cubeModel(const CubeDraw &c);
+
+/* One of each mesh a tile or the block is drawn with */
+struct SceneMeshes {
+  VAO *top[2];            // plain, fragile
+  VAO *wall[2][2];        // plain, fragile; then mirrored
+  VAO *cross, *disc, *cube;
+
+  void create();
+  void destroy();
+};
+
+/* The stage at rest with the block on its start, from the preview camera */
+struct Scene {
+  glm::mat4 VP;
+  vector<TileDraw> tiles;
+  vector<CubeDraw> cubes;
+};
+
+void previewScene(const Levels &levels, int level, Scene &scene);
+void drawScene(const SceneMeshes &meshes, const Scene &scene);
+int sceneTriangles(const SceneMeshes &meshes, const Scene &scene);
+
+/* Software rasteriser behind the RenderBackend interface, for level
+   thumbnails on machines without a GL stack. It draws what Sample_GL does:
+   triangles with interpolated vertex colours, back faces culled and a
+   GL_LEQUAL depth test. draw() transforms, near-clips and bins triangles into
+   SOFT_TILE square screen tiles; finish() rasterises the tiles on a pool of
+   worker threads started with the backend, SOFT_LANES pixels of a row at a
+   time. Rows are bottom first, as glReadPixels returns them */
+#define SOFT_TILE 32          // tile edge in pixels, a multiple of SOFT_LANES
+
+/* A triangle ready to rasterise: the edge functions give each vertex's
+   barycentric weight at a pixel centre, a*x + b*y + c */
+struct SoftTriangle {
+  float a[3], b[3], c[3];
+  float z[3];                 // window depth, 0..1
+  float q[3];                 // 1/w, for perspective correct colours
+  float cq[3][3];             // colour over w
+  int x0, y0, x1, y1;         // pixel bounds
+};
+
+/* A clip space vertex and its colour */
+struct SoftVertex {
+  glm::vec4 clip;
+  glm::vec3 color;
+};
+
+class SoftBackend : public PictureBackend {
+  vector<MeshVertex> meshes;            // every mesh, back to back
+  int width, height, stride, tiles_x, tiles_y;
+  vector<uint32_t> color;               // stride pixels a row, padded to whole tiles
+  vector<float> depth;
+  vector<SoftTriangle> triangles;
+  vector< vector<int> > bins;           // per tile, triangles in the order they were drawn
+  std::atomic<int> next_tile;
+
+  // the pool: finish() bumps picture and wakes the workers, each counts itself
+  // off in busy once no tile is left; quit ends them
+  vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable wake, done;
+  long picture;
+  int busy;
+  bool quit;
+
+  void setup(const SoftVertex &v0, const SoftVertex &v1, const SoftVertex &v2);
+  void rasterTile(int tile);
+  void rasterTiles();
+  void work();
+
+public:
+  SoftBackend(int threads=0);     // 0 for one a core
+  ~SoftBackend();
+  int threads() const { return workers.size()+1; }
+  static int lanes();
+
+  const char *name() { return "software"; }
+  void upload(VAO *vao, const MeshVertex *vertices);
+  void release(VAO *vao);
+  void begin(int width, int height);
+  void draw(VAO *vao, const glm::mat4 &MVP);
+  void finish();
+  void read(vector<unsigned char> &rgb);
+};
+
+/* dir/level-N.ppm for every level through backend, each drawn THUMBNAIL_RUNS
+   times with the timings printed. Points render_backend at backend */
+#define THUMBNAIL_RUNS 20
+
+void renderThumbnails(PictureBackend &backend, const string &dir, int width, int height);
+
+#endif
@@ -0,0 +1,190 @@
+/* The thumbnails tool's pictures through GL, without a window or a display:
+   the same scenes from scene.cpp drawn with Sample_GL in an EGL surfaceless
+   context, into a renderbuffer. With LIBGL_ALWAYS_SOFTWARE=1 that is Mesa's
+   llvmpipe, to set against SoftBackend in ./thumbnails dir
+
+     make thumbnail_bench && LIBGL_ALWAYS_SOFTWARE=1 ./thumbnail_bench dir */
+#include <cstdio>
+#include <cstddef>
+
+#define EGL_NO_X11    // keep Xlib macros out
+#include <glad/glad.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "scene.h"
+
+/* GLSL sources, embedded at build time from the .vert/.frag files (see Makefile) */
+#include "shaders.h"
+
+/* Meshes back to back in one vertex buffer, as the game keeps them, drawn
+   with Sample_GL into a colour and depth renderbuffer */
+class EglBackend : public PictureBackend {
+  vector<MeshVertex> meshes;
+  size_t uploaded;                    // vertices in buffer
+  GLuint program, mvp, array, buffer;
+  GLuint fbo, color, depth;
+  int width, height;
+
+  GLuint compile(GLenum type, const char *code)
+  {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &code, NULL);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if(!ok)
+    {
+      char log[1024] = "";
+      glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+      fprintf(stderr, "Sample_GL: %s\n", log);
+    }
+    return shader;
+  }
+
+public:
+  EglBackend() : uploaded(0), fbo(0), color(0), depth(0), width(0), height(0)
+  {
+    GLuint vertex = compile(GL_VERTEX_SHADER, Sample_GL_vert), fragment = compile(GL_FRAGMENT_SHADER, Sample_GL_frag);
+    program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    mvp = glGetUniformLocation(program, "MVP");
+
+    glGenVertexArrays(1, &array);
+    glGenBuffers(1, &buffer);
+    glBindVertexArray(array);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, color));
+  }
+
+  ~EglBackend()
+  {
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+    glDeleteBuffers(1, &buffer);
+    glDeleteVertexArrays(1, &array);
+    glDeleteProgram(program);
+  }
+
+  const char *name() { return (const char *)glGetString(GL_RENDERER); }
+
+  void upload(VAO *vao, const MeshVertex *vertices)
+  {
+    vao->First = meshes.size();
+    vao->VertexArrayID = array;
+    meshes.insert(meshes.end(), vertices, vertices+vao->NumVertices);
+  }
+
+  void release(VAO *vao)
+  {
+    if(vao->First+vao->NumVertices==(int)meshes.size())
+      meshes.resize(vao->First);
+  }
+
+  /* New meshes go to the buffer here, a new size gets new renderbuffers. The
+     state is what initGL and the scene pass leave for the game */
+  void begin(int w, int h)
+  {
+    if(uploaded!=meshes.size())
+    {
+      glBindBuffer(GL_ARRAY_BUFFER, buffer);
+      glBufferData(GL_ARRAY_BUFFER, meshes.size()*sizeof(MeshVertex), &meshes[0], GL_STATIC_DRAW);
+      uploaded = meshes.size();
+    }
+    if(w!=width || h!=height)
+    {
+      width = w;
+      height = h;
+      glDeleteFramebuffers(1, &fbo);
+      glDeleteRenderbuffers(1, &color);
+      glDeleteRenderbuffers(1, &depth);
+      glGenFramebuffers(1, &fbo);
+      glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+      glGenRenderbuffers(1, &color);
+      glBindRenderbuffer(GL_RENDERBUFFER, color);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+      glGenRenderbuffers(1, &depth);
+      glBindRenderbuffer(GL_RENDERBUFFER, depth);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+      glViewport(0, 0, w, h);
+    }
+    glUseProgram(program);
+    glBindVertexArray(array);
+    glClearColor (255.0/255, 250.0/255.0, 250.0/255.0, 0.0f);
+    glClearDepth (1.0f);
+    glEnable (GL_DEPTH_TEST);
+    glDepthFunc (GL_LEQUAL);
+    glEnable(GL_CULL_FACE);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  }
+
+  void draw(VAO *vao, const glm::mat4 &MVP)
+  {
+    glUniformMatrix4fv(mvp, 1, GL_FALSE, &MVP[0][0]);
+    glPolygonMode(GL_FRONT_AND_BACK, vao->FillMode);
+    glDrawArrays(vao->PrimitiveMode, vao->First, vao->NumVertices);
+  }
+
+  void finish()
+  {
+    glFinish();
+  }
+
+  void read(vector<unsigned char> &rgb)
+  {
+    rgb.resize((long)width*height*3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &rgb[0]);
+  }
+};
+
+int main (int argc, char** argv)
+{
+  const char *dir = argc>1 ? argv[1] : ".";
+
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  EGLDisplay display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : EGL_NO_DISPLAY;
+  EGLint major, minor;
+  if(display==EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+  {
+    fprintf(stderr, "No surfaceless EGL display\n");
+    return 1;
+  }
+  eglBindAPI(EGL_OPENGL_API);
+  const EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  EGLConfig config;
+  EGLint configs = 0;
+  eglChooseConfig(display, config_attribs, &config, 1, &configs);
+  const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE
+  };
+  EGLContext context = eglCreateContext(display, configs ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
+  if(context==EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+  {
+    fprintf(stderr, "Cannot make a GL 3.3 core context current (EGL error 0x%x)\n", eglGetError());
+    return 1;
+  }
+  gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+  {
+    EglBackend gl;
+    renderThumbnails(gl, dir, 320, 280);
+  }
+
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+  return 0;
+}
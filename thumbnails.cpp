@@ -0,0 +1,20 @@
+/* Level thumbnails with no window and no GL: writes dir/level-N.ppm for
+   every level, the stage at rest with the block on its start from the
+   preview camera, drawn by SoftBackend. Links nothing but scene.cpp; see
+   thumbnail_bench.cpp for the same pictures through GL
+
+     make thumbnails && ./thumbnails dir [threads] */
+#include <cstdio>
+#include <cstdlib>
+
+#include "scene.h"
+
+int main (int argc, char** argv)
+{
+  const char *dir = argc>1 ? argv[1] : ".";
+  SoftBackend soft(argc>2 ? atoi(argv[2]) : 0);
+
+  renderThumbnails(soft, dir, 320, 280);
+  printf("  %d threads, %d pixel lanes, %d pixel tiles\n", soft.threads(), SoftBackend::lanes(), SOFT_TILE);
+  return 0;
+}